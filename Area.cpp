@@ -1,14 +1,136 @@
 
+#include <atomic>
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <unordered_set>
 #include <gdalcpp.hpp>
 #include <osmium/osm/area.hpp>
 
 #include "Area.hpp"
+#include "Profiler.hpp"
 
-static uint64_t	globalid=0;
+/* Shared by all batch workers - ids only need to be unique per index */
+static std::atomic<uint64_t>	globalid{0};
+
+typedef std::pair<const AreaNode*, const AreaNode*>			segment_t;
+
+/* Boundary segments per chunk - the window walks skip whole chunks */
+static const uint32_t	chunksize=32;
+
+/* Above this many segment pairs a SegmentIndex beats the nested loop */
+static const size_t	pairlimit=4096;
+
+static segkey_t segkey(const AreaNode& n1, const AreaNode& n2) {
+	if (n1.ref < n2.ref)
+		return segkey_t(n1.ref, n2.ref);
+	return segkey_t(n2.ref, n1.ref);
+}
+
+static bool inenvelope(const OGREnvelope& env, double x, double y) {
+	return x >= env.MinX && x <= env.MaxX
+		&& y >= env.MinY && y <= env.MaxY;
+}
+
+static bool segmentinenvelope(const OGREnvelope& env, const AreaNode& n1, const AreaNode& n2) {
+	return std::max(n1.x, n2.x) >= env.MinX && std::min(n1.x, n2.x) <= env.MaxX
+		&& std::max(n1.y, n2.y) >= env.MinY && std::min(n1.y, n2.y) <= env.MaxY;
+}
+
+static double orientation(const AreaNode& p, const AreaNode& q, const AreaNode& r) {
+	return (q.x-p.x)*(r.y-p.y)-(q.y-p.y)*(r.x-p.x);
+}
+
+/* Segments cross in their interiors - touching or collinear does not count */
+static bool segmentscross(const segment_t& s1, const segment_t& s2) {
+	double	d1=orientation(*s2.first, *s2.second, *s1.first);
+	double	d2=orientation(*s2.first, *s2.second, *s1.second);
+	double	d3=orientation(*s1.first, *s1.second, *s2.first);
+	double	d4=orientation(*s1.first, *s1.second, *s2.second);
+
+	return ((d1 > 0 && d2 < 0) || (d1 < 0 && d2 > 0))
+		&& ((d3 > 0 && d4 < 0) || (d3 < 0 && d4 > 0));
+}
+
+/*
+ * Distance in meters from p to the segment n1/n2 using a local
+ * equirectangular approximation which is good enough for small distances.
+ */
+static double segmentdistance(const AreaNode& p, const AreaNode& n1, const AreaNode& n2) {
+	double	scale=cos(p.y*M_PI/180);
+	double	dx=(n2.x-n1.x)*scale, dy=n2.y-n1.y;
+	double	px=(p.x-n1.x)*scale, py=p.y-n1.y;
+	double	len=dx*dx+dy*dy;
+	double	t=(len > 0) ? (px*dx+py*dy)/len : 0;
+
+	t=std::max(0.0, std::min(1.0, t));
+
+	double	ex=px-t*dx, ey=py-t*dy;
+
+	return sqrt(ex*ex+ey*ey)*111320;
+}
+
+static Segment tosegment(const segment_t& s) {
+	return Segment{s.first->x, s.first->y, s.second->x, s.second->y};
+}
+
+/*
+ * Call f for the boundary segments of a in all chunks touching window.
+ * Stops and returns false as soon as f does.
+ */
+template <typename F>
+static bool windowsegments(const Area *a, const OGREnvelope& window, F f) {
+	for(auto& c : a->chunks) {
+		if (!c.env.Intersects(window))
+			continue;
+
+		const std::vector<AreaNode>&	ring=a->rings[c.ring];
+		for(uint32_t i=c.first;i<c.last;i++)
+			if (!f(ring[i], ring[i+1]))
+				return false;
+	}
+
+	return true;
+}
+
+/*
+ * Checks from the view of area a whether all of its boundary within the
+ * common envelope is made up of segments shared with area b. Segments
+ * not shared but passing the window are returned in loose for the
+ * crossing test. Shared segments lie in both envelopes so walking the
+ * window only sees all of them.
+ */
+static bool sharedonly(const Area *a, const Area *b, const OGREnvelope& window, std::vector<segment_t>& loose) {
+	size_t	shared=0;
+
+	bool	clean=windowsegments(a, window, [&](const AreaNode& n1, const AreaNode& n2) {
+		if (b->segset.count(segkey(n1, n2))) {
+			shared++;
+			return true;
+		}
+
+		/* A vertex not on b within the window may be inside b */
+		if (!b->nodeset.count(n1.ref) && inenvelope(window, n1.x, n1.y))
+			return false;
+
+		/* Chord between two shared nodes - may run through b */
+		if (b->nodeset.count(n1.ref) && b->nodeset.count(n2.ref))
+			return false;
+
+		if (segmentinenvelope(window, n1, n2))
+			loose.push_back(segment_t(&n1, &n2));
+
+		return true;
+	});
+
+	/* Fully shared boundaries are duplicates which we want to see */
+	return clean && shared > 0 && shared < a->segments;
+}
 
 Area::~Area(void ) {
+	delete(segindex);
 	delete(geometry);
+	free((void *) osm_value);
 }
 
 Area::Area(std::unique_ptr<OGRGeometry> geom, uint8_t otype, const osmium::Area &area) :
@@ -51,20 +173,465 @@ Area::Area(std::unique_ptr<OGRGeometry> geom, uint8_t otype, const osmium::Area
 	id=globalid++;
 }
 
+void Area::addrings(const osmium::Area &area) {
+	for(const auto& outer : area.outer_rings()) {
+		std::vector<AreaNode>	ring;
+		for(const auto& nr : outer)
+			ring.push_back(AreaNode{nr.ref(), nr.location().lon(), nr.location().lat()});
+		rings.push_back(std::move(ring));
+
+		for(const auto& inner : area.inner_rings(outer)) {
+			std::vector<AreaNode>	iring;
+			for(const auto& nr : inner)
+				iring.push_back(AreaNode{nr.ref(), nr.location().lon(), nr.location().lat()});
+			rings.push_back(std::move(iring));
+		}
+	}
+}
+
+/*
+ * Node and segment lookups plus chunk envelopes of the rings. Only
+ * areas which actually meet a glued neighbour pay for them.
+ */
+void Area::buildboundary(void ) {
+	if (segments || rings.empty())
+		return;
+
+	for(uint32_t r=0;r<rings.size();r++) {
+		const std::vector<AreaNode>&	ring=rings[r];
+
+		for(uint32_t i=0;i+1<ring.size();i++) {
+			nodeset.insert(ring[i].ref);
+			segset.insert(segkey(ring[i], ring[i+1]));
+			segments++;
+
+			if (i % chunksize == 0) {
+				BoundaryChunk	c;
+				c.ring=r;
+				c.first=i;
+				c.env.MinX=c.env.MaxX=ring[i].x;
+				c.env.MinY=c.env.MaxY=ring[i].y;
+				chunks.push_back(c);
+			}
+
+			BoundaryChunk&	c=chunks.back();
+			c.last=i+1;
+			c.env.MinX=std::min(c.env.MinX, ring[i+1].x);
+			c.env.MaxX=std::max(c.env.MaxX, ring[i+1].x);
+			c.env.MinY=std::min(c.env.MinY, ring[i+1].y);
+			c.env.MaxY=std::max(c.env.MaxY, ring[i+1].y);
+		}
+	}
+}
+
+/* Without glued neighbours the boundary is never looked at again */
+void Area::dropboundary(void ) {
+	std::vector<std::vector<AreaNode>>().swap(rings);
+	std::unordered_set<osmium::object_id_type>().swap(nodeset);
+	std::unordered_set<segkey_t, segkey_hash>().swap(segset);
+	std::vector<BoundaryChunk>().swap(chunks);
+	segments=0;
+}
+
 void Area::envelope(OGREnvelope& env) {
 	geometry->getEnvelope(&env);
 }
 
+/*
+ * Areas glued by shared ways have overlapping envelopes but mostly only
+ * touch. If all boundary within the common envelope is shared, no other
+ * vertex lies in it and the remaining segments do not cross we can
+ * skip GEOS. Anything unclear returns false and takes the slow path.
+ */
+bool Area::touchesonly(Area *oa) {
+	if (std::find(neighbours.begin(), neighbours.end(), oa) == neighbours.end())
+		return false;
+
+	OGREnvelope	window, oenv;
+	envelope(window);
+	oa->envelope(oenv);
+	window.Intersect(oenv);
+
+	std::vector<segment_t>	aloose, bloose;
+
+	buildboundary();
+	oa->buildboundary();
+
+	if (!sharedonly(this, oa, window, aloose))
+		return false;
+	if (!sharedonly(oa, this, window, bloose))
+		return false;
+
+	if (aloose.size()*bloose.size() <= pairlimit) {
+		for(auto& as : aloose)
+			for(auto& bs : bloose)
+				if (segmentscross(as, bs))
+					return false;
+		return true;
+	}
+
+	std::vector<Segment>	bsegs;
+	for(auto& bs : bloose)
+		bsegs.push_back(tosegment(bs));
+
+	SegmentIndex	bindex{std::move(bsegs)};
+	for(auto& as : aloose)
+		if (bindex.crossing(tosegment(as)) == CROSS_PROPER)
+			return false;
+
+	return true;
+}
+
+/*
+ * Look for a vertex of ours which is not shared with the glued neighbour
+ * but closer than tolerance meters to one of its unshared segments.
+ * Thats a sliver or gap where the mapper missed gluing the ways.
+ */
+bool Area::gluedgap(Area *oa, double tolerance, double &x, double &y) {
+	OGREnvelope	window, oenv;
+	envelope(window);
+	oa->envelope(oenv);
+	window.Intersect(oenv);
+
+	/* Roughly widen the window by the tolerance in degrees */
+	double	margin=tolerance/111320/std::max(0.1, cos(window.MinY*M_PI/180));
+	window.MinX-=margin; window.MaxX+=margin;
+	window.MinY-=margin; window.MaxY+=margin;
+
+	buildboundary();
+	oa->buildboundary();
+
+	/* Unshared segments of the neighbour near the window */
+	std::vector<Segment>	osegs;
+	windowsegments(oa, window, [&](const AreaNode& n1, const AreaNode& n2) {
+		if (!nodeset.count(n1.ref) && !nodeset.count(n2.ref)
+				&& segmentinenvelope(window, n1, n2))
+			osegs.push_back(Segment{n1.x, n1.y, n2.x, n2.y});
+		return true;
+	});
+
+	if (osegs.empty())
+		return false;
+
+	/* Our unshared vertices within the window */
+	std::vector<const AreaNode*>	vertices;
+	windowsegments(this, window, [&](const AreaNode& n1, const AreaNode&) {
+		if (!oa->nodeset.count(n1.ref) && inenvelope(window, n1.x, n1.y))
+			vertices.push_back(&n1);
+		return true;
+	});
+
+	auto gap=[&](const AreaNode& n, const Segment& s) {
+		double d=segmentdistance(n, AreaNode{0, s.x1, s.y1}, AreaNode{0, s.x2, s.y2});
+		if (d > 0 && d < tolerance) {
+			x=n.x;
+			y=n.y;
+			return true;
+		}
+		return false;
+	};
+
+	if (vertices.size()*osegs.size() <= pairlimit) {
+		for(auto n : vertices)
+			for(auto& s : osegs)
+				if (gap(*n, s))
+					return true;
+		return false;
+	}
+
+	SegmentIndex		oindex{std::move(osegs)};
+	std::vector<uint32_t>	list;
+
+	for(auto n : vertices) {
+		/* The window margin is taken at its southern edge */
+		double	m=tolerance/111320/std::max(0.1, cos(n->y*M_PI/180));
+
+		list.clear();
+		oindex.nearby(n->x, n->y, std::max(m, margin), list);
+		for(auto i : list)
+			if (gap(*n, oindex.segment(i)))
+				return true;
+	}
+
+	return false;
+}
+
+void Area::buildsegmentindex(void ) {
+	if (!segindex)
+		segindex=new SegmentIndex(geometry);
+}
+
+bool Area::containspoint(double x, double y) {
+	if (segindex)
+		return segindex->contains(x, y);
+
+	OGRPoint	p(x, y);
+	return geometry->Contains(&p);
+}
+
+static void ringstarts(const OGRGeometry *geom, std::vector<std::pair<double, double>>& list) {
+	switch(geom->getGeometryType()) {
+		case(wkbPolygon): {
+			const OGRPolygon	*poly=static_cast<const OGRPolygon*>(geom);
+			const OGRLinearRing	*ring=poly->getExteriorRing();
+			if (ring->getNumPoints() > 0)
+				list.push_back(std::make_pair(ring->getX(0), ring->getY(0)));
+			for(int i=0;i<poly->getNumInteriorRings();i++) {
+				ring=poly->getInteriorRing(i);
+				if (ring->getNumPoints() > 0)
+					list.push_back(std::make_pair(ring->getX(0), ring->getY(0)));
+			}
+			break;
+		}
+		case(wkbMultiPolygon): {
+			const OGRMultiPolygon	*mp=static_cast<const OGRMultiPolygon*>(geom);
+			for(int i=0;i<mp->getNumGeometries();i++)
+				ringstarts(mp->getGeometryRef(i), list);
+			break;
+		}
+		default: {
+			break;
+		}
+	}
+}
+
+/*
+ * Count the rings of area a lying inside area b. Only valid when the
+ * boundaries do not touch as then every ring is completely inside or
+ * outside. Rings starting outside the envelope of b can not be inside.
+ */
+static size_t ringsinside(Area *a, Area *b, size_t& total) {
+	std::vector<std::pair<double, double>>	starts;
+	OGREnvelope				env;
+	size_t					inside=0;
+
+	ringstarts(a->geometry, starts);
+	b->envelope(env);
+
+	for(auto& p : starts) {
+		if (p.first < env.MinX || p.first > env.MaxX
+			|| p.second < env.MinY || p.second > env.MaxY)
+			continue;
+		if (b->containspoint(p.first, p.second))
+			inside++;
+	}
+
+	total=starts.size();
+	return inside;
+}
+
+/*
+ * Topology for pairs where at least one side carries a segment index.
+ * Only the clear cases are answered, everything else is left to GEOS
+ * by returning RELATE_UNKNOWN.
+ */
+int Area::relate(Area *oa) {
+	Area	*g=segindex ? this : oa;
+	Area	*o=(g == this) ? oa : this;
+
+	if (!g->segindex)
+		return RELATE_UNKNOWN;
+
+	int	c=g->segindex->crossing(o->geometry);
+
+	if (c == CROSS_PROPER)
+		return RELATE_CROSS;
+	if (c == CROSS_TOUCH)
+		return RELATE_UNKNOWN;
+
+	size_t	ototal, gtotal;
+	size_t	oin=ringsinside(o, g, ototal);
+	size_t	gin=ringsinside(g, o, gtotal);
+
+	int	r=RELATE_UNKNOWN;
+
+	if (oin == 0 && gin == 0)
+		r=RELATE_DISJOINT;
+	else if (oin == ototal && gin == 0)
+		r=(g == this) ? RELATE_CONTAINS : RELATE_WITHIN;
+	else if (gin == gtotal && oin == 0)
+		r=(g == this) ? RELATE_WITHIN : RELATE_CONTAINS;
+
+	return r;
+}
+
 bool Area::overlaps(Area *oa) {
+	ProfileScope	profile{"overlaps", this, oa};
+
+	if (touchesonly(oa))
+		return false;
+
+	switch(relate(oa)) {
+		case(RELATE_DISJOINT):
+			return false;
+		case(RELATE_CROSS):
+		case(RELATE_CONTAINS):
+		case(RELATE_WITHIN):
+			return true;
+	}
+
 	return geometry->Overlaps(oa->geometry)
 		|| geometry->Contains(oa->geometry)
 		|| geometry->Within(oa->geometry);
 }
 
 bool Area::intersects(Area *oa) {
+	ProfileScope	profile{"intersects", this, oa};
+
+	if (touchesonly(oa))
+		return false;
+
+	switch(relate(oa)) {
+		case(RELATE_CROSS):
+			return true;
+		case(RELATE_DISJOINT):
+		case(RELATE_CONTAINS):
+		case(RELATE_WITHIN):
+			return false;
+	}
+
 	return geometry->Overlaps(oa->geometry);
 }
 
+/* Sutherland-Hodgman of a ring against one side of the envelope */
+static void clipside(std::vector<std::pair<double, double>>& pts, int side, double v) {
+	std::vector<std::pair<double, double>>	out;
+
+	auto inside=[side, v](const std::pair<double, double>& p) {
+		switch(side) {
+			case(0): return p.first >= v;
+			case(1): return p.first <= v;
+			case(2): return p.second >= v;
+			default: return p.second <= v;
+		}
+	};
+
+	auto cut=[side, v](const std::pair<double, double>& p, const std::pair<double, double>& q) {
+		if (side < 2) {
+			double t=(v-p.first)/(q.first-p.first);
+			return std::make_pair(v, p.second+t*(q.second-p.second));
+		}
+		double t=(v-p.second)/(q.second-p.second);
+		return std::make_pair(p.first+t*(q.first-p.first), v);
+	};
+
+	for(size_t i=0;i<pts.size();i++) {
+		const auto&	cur=pts[i];
+		const auto&	prev=pts[(i+pts.size()-1)%pts.size()];
+
+		if (inside(cur)) {
+			if (!inside(prev))
+				out.push_back(cut(prev, cur));
+			out.push_back(cur);
+		} else if (inside(prev)) {
+			out.push_back(cut(prev, cur));
+		}
+	}
+
+	pts.swap(out);
+}
+
+static OGRLinearRing *clipring(const OGRLinearRing *ring, const OGREnvelope& env) {
+	std::vector<std::pair<double, double>>	pts;
+
+	/* Drop the closing point, clipside treats the ring as closed */
+	for(int i=0;i+1<ring->getNumPoints();i++)
+		pts.push_back(std::make_pair(ring->getX(i), ring->getY(i)));
+
+	clipside(pts, 0, env.MinX);
+	clipside(pts, 1, env.MaxX);
+	clipside(pts, 2, env.MinY);
+	clipside(pts, 3, env.MaxY);
+
+	if (pts.size() < 3)
+		return nullptr;
+
+	OGRLinearRing	*out=new OGRLinearRing();
+	for(auto& p : pts)
+		out->addPoint(p.first, p.second);
+	out->closeRings();
+
+	return out;
+}
+
+/*
+ * Cut our geometry down to the envelope so the following GEOS
+ * intersection only sees the vertices close to the other area.
+ * Clipping may leave degenerate edges along the envelope border so
+ * the caller should pass an envelope slightly larger than needed.
+ */
+OGRGeometry *Area::clipped(const OGREnvelope& env) {
+	OGRMultiPolygon		*result=new OGRMultiPolygon();
+	const OGRMultiPolygon	*mp=static_cast<const OGRMultiPolygon*>(geometry);
+
+	for(int i=0;i<mp->getNumGeometries();i++) {
+		const OGRPolygon	*poly=static_cast<const OGRPolygon*>(mp->getGeometryRef(i));
+		OGREnvelope		penv;
+
+		poly->getEnvelope(&penv);
+		if (!penv.Intersects(env))
+			continue;
+
+		OGRLinearRing	*outer=clipring(poly->getExteriorRing(), env);
+		if (!outer)
+			continue;
+
+		OGRPolygon	*cpoly=new OGRPolygon();
+		cpoly->addRingDirectly(outer);
+
+		for(int j=0;j<poly->getNumInteriorRings();j++) {
+			OGRLinearRing	*inner=clipring(poly->getInteriorRing(j), env);
+			if (inner)
+				cpoly->addRingDirectly(inner);
+		}
+
+		result->addGeometryDirectly(cpoly);
+	}
+
+	result->assignSpatialReference(geometry->getSpatialReference());
+
+	return result;
+}
+
+/* Degrees² to m² with the scale at the envelope centre - fine for thresholds */
+static double degreescale(const OGREnvelope& env) {
+	return 111320.0*111320.0*cos((env.MinY+env.MaxY)/2*M_PI/180);
+}
+
+double squaremeters(const OGREnvelope& env) {
+	return (env.MaxX-env.MinX)*(env.MaxY-env.MinY)*degreescale(env);
+}
+
+double squaremeters(const OGRGeometry *geom) {
+	OGREnvelope	env;
+	double		area=0;
+
+	switch(geom->getGeometryType()) {
+		case(wkbPolygon): {
+			area=static_cast<const OGRPolygon*>(geom)->get_Area();
+			break;
+		}
+		case(wkbMultiPolygon):
+		case(wkbGeometryCollection): {
+			area=static_cast<const OGRGeometryCollection*>(geom)->get_Area();
+			break;
+		}
+		default: {
+			return 0;
+		}
+	}
+
+	geom->getEnvelope(&env);
+
+	return area*degreescale(env);
+}
+
+double Area::squaremeters(void ) {
+	if (sqm < 0)
+		sqm=::squaremeters(geometry);
+	return sqm;
+}
+
 const char *Area::source_string(void ) {
 	return (source == SRC_WAY) ? "way" : "relation";
 }
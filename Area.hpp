@@ -1,9 +1,12 @@
 #ifndef AREA_HPP
 #define AREA_HPP
 
+#include <unordered_set>
 #include <gdalcpp.hpp>
 #include <osmium/osm/area.hpp>
 
+#include "SegmentIndex.hpp"
+
 enum {
 	AREA_UNKNOWN,
 	AREA_NATURAL,
@@ -19,12 +22,48 @@ enum {
 	SRC_WAY
 };
 
+enum {
+	RELATE_UNKNOWN,
+	RELATE_DISJOINT,
+	RELATE_CROSS,
+	RELATE_CONTAINS,
+	RELATE_WITHIN
+};
+
+class AreaNode {
+	public:
+	osmium::object_id_type			ref;
+	double					x;
+	double					y;
+};
+
+typedef std::pair<osmium::object_id_type, osmium::object_id_type>	segkey_t;
+
+class segkey_hash {
+	public:
+	size_t operator()(const segkey_t& k) const {
+		std::hash<osmium::object_id_type>	h;
+		return h(k.first)*31+h(k.second);
+	}
+};
+
+/* A run of boundary segments of one ring and their envelope */
+class BoundaryChunk {
+	public:
+	uint32_t				ring;
+	uint32_t				first;
+	uint32_t				last;
+	OGREnvelope				env;
+};
+
 class Area {
 	public:
 	const OGRGeometry			*geometry;
 	uint8_t					source;
 
 	uint64_t				id;
+	/* Position in AreaIndex::arealist */
+	size_t					listpos=0;
 
 	uint8_t					osm_type;
 	int					osm_layer=0;
@@ -35,14 +74,42 @@ class Area {
 	const char				*osm_key;
 	const char				*osm_value;
 
+	/* Boundary node ids - only kept for areas in the adjacency index */
+	std::vector<std::vector<AreaNode>>	rings;
+	std::vector<Area*>			neighbours;
+
+	/* Built from the rings on first use by the glued neighbour checks */
+	std::unordered_set<osmium::object_id_type>	nodeset;
+	std::unordered_set<segkey_t, segkey_hash>	segset;
+	std::vector<BoundaryChunk>		chunks;
+	size_t					segments=0;
+
+	/* Only built for areas above the giant vertex threshold */
+	SegmentIndex				*segindex=nullptr;
+
+	/* Approximate area in m², computed on first use */
+	double					sqm=-1;
 
 	~Area();
 	Area(std::unique_ptr<OGRGeometry> geom, uint8_t otype, const osmium::Area &area);
 	void envelope(OGREnvelope& env);
 	bool overlaps(Area *oa);
 	bool intersects(Area *oa);
+	void addrings(const osmium::Area &area);
+	void buildboundary(void );
+	void dropboundary(void );
+	bool touchesonly(Area *oa);
+	bool gluedgap(Area *oa, double tolerance, double &x, double &y);
+	void buildsegmentindex(void );
+	bool containspoint(double x, double y);
+	int relate(Area *oa);
+	OGRGeometry *clipped(const OGREnvelope& env);
+	double squaremeters(void );
 	const char *source_string(void);
 	void dump(void );
 };
 
+double squaremeters(const OGRGeometry *geom);
+double squaremeters(const OGREnvelope& env);
+
 #endif
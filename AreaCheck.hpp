@@ -7,6 +7,7 @@ class SpatiaLiteWriter;
 
 class AreaWant {
 	public:
+	virtual const char *Name() const = 0;
 	virtual bool WantA(Area *a) const = 0;
 	virtual bool WantB(Area *a) const = 0;
 };
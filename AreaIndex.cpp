@@ -1,17 +1,41 @@
 
 #include <gdalcpp.hpp>
 #include <osmium/handler.hpp>
+
+// For assembling multipolygons
+#include <osmium/area/assembler.hpp>
+#include <osmium/area/multipolygon_manager.hpp>
+
+// For the NodeLocationForWays handler
+#include <osmium/handler/node_locations_for_ways.hpp>
+
+// Allow any format of input files (XML, PBF, ...)
+#include <osmium/io/any_input.hpp>
+
+// For the location index. There are different types of indexes available.
+// This will work for all input files keeping the index in memory.
+#include <osmium/index/map/flex_mem.hpp>
 #include <spatialindex/capi/sidx_api.h>
 #include <SpatialIndex.h>
 #include <osmium/geom/ogr.hpp>
+#include <unordered_set>
+#include <algorithm>
 
 #include "Area.hpp"
 #include "AreaCheck.hpp"
 #include "AreaIndex.hpp"
 #include "SpatiaLiteWriter.hpp"
+#include "Stats.hpp"
+#include "Profiler.hpp"
 
 #define DEBUG	0
 
+// The type of index used. This must match the include file above
+using index_type = osmium::index::map::FlexMem<osmium::unsigned_object_id_type, osmium::Location>;
+
+// The location handler always depends on the index type
+using location_handler_type = osmium::handler::NodeLocationsForWays<index_type>;
+
 namespace si = SpatialIndex;
 
 template <typename AT>
@@ -37,12 +61,12 @@ class query_visitor : public si::IVisitor {
 	}
 };
 
-si::Region AreaIndex::region(Area *area) {
+static si::Region arearegion(Area *area) {
 	OGREnvelope	env;
 	area->envelope(env);
 
-	coord_array_t const p1 = { env.MinX, env.MinY };
-	coord_array_t const p2 = { env.MaxX, env.MaxY };
+	std::array<double, 2> const p1 = { env.MinX, env.MinY };
+	std::array<double, 2> const p2 = { env.MaxX, env.MaxY };
 
 	si::Region region(
 		si::Point(p1.data(), p1.size()),
@@ -51,6 +75,45 @@ si::Region AreaIndex::region(Area *area) {
 	return region;
 }
 
+class want_all : public AreaWant {
+	public:
+	const char *Name() const { return "all"; }
+	bool WantA(Area *) const { return true; }
+	bool WantB(Area *) const { return true; }
+};
+
+si::Region AreaIndex::region(Area *area) {
+	return arearegion(area);
+}
+
+/* Feeds the area list to the R-tree bulk loader */
+class area_stream : public si::IDataStream {
+	std::vector<Area*>&	list;
+	size_t			pos=0;
+
+	public:
+
+	area_stream(std::vector<Area*>& l) : list(l) {}
+
+	si::IData *getNext() {
+		Area		*area=list[pos++];
+		si::Region	r=arearegion(area);
+		return new si::RTree::Data(0, nullptr, r, (uint64_t) area);
+	}
+
+	bool hasNext() {
+		return pos < list.size();
+	}
+
+	uint32_t size() {
+		return list.size();
+	}
+
+	void rewind() {
+		pos=0;
+	}
+};
+
 AreaIndex::AreaIndex() {
 	sm=si::StorageManager::createNewMemoryStorageManager();
 	rtree=si::RTree::createNewRTree(*sm, fill_factor, index_capacity, leaf_capacity, dimension, si::RTree::RV_LINEAR, index_id);
@@ -58,17 +121,311 @@ AreaIndex::AreaIndex() {
 	oSRS.importFromEPSG(4326);
 }
 
+/* The areas are not ours - they are handed out via arealist */
+AreaIndex::~AreaIndex() {
+	delete(rtree);
+	delete(sm);
+}
+
+/* Areas with at least threshold vertices get their own segment index */
+void AreaIndex::setgiant(size_t threshold) {
+	giant_threshold=threshold;
+}
+
+/* Glued neighbour detection - costs memory per boundary vertex */
+void AreaIndex::setadjacency(bool enable) {
+	withadjacency=enable;
+}
+
+bool AreaIndex::adjacencyenabled(void ) const {
+	return withadjacency;
+}
+
+/*
+ * Throw away the R-tree and build it again from arealist with STR
+ * bulk loading. Packs the nodes much better than single inserts.
+ */
+void AreaIndex::bulkload(void ) {
+	delete(rtree);
+	delete(sm);
+	sm=si::StorageManager::createNewMemoryStorageManager();
+
+	if (arealist.empty()) {
+		rtree=si::RTree::createNewRTree(*sm, fill_factor, index_capacity, leaf_capacity, dimension, si::RTree::RV_LINEAR, index_id);
+		return;
+	}
+
+	area_stream	stream{arealist};
+	rtree=si::RTree::createAndBulkLoadNewRTree(si::RTree::BLM_STR, stream, *sm, fill_factor, index_capacity, leaf_capacity, dimension, si::RTree::RV_LINEAR, index_id);
+}
+
+size_t AreaIndex::giant(void ) const {
+	return giant_threshold;
+}
+
 void AreaIndex::findoverlapping(Area *area, std::vector<Area*> *list, AreaWant& want) {
 	query_visitor<Area> qvisitor{list, want};
 	rtree->intersectsWithQuery(region(area), qvisitor);
 }
 
+void AreaIndex::findregion(const OGREnvelope& env, std::vector<Area*> *list) {
+	std::array<double, 2> const p1 = { env.MinX, env.MinY };
+	std::array<double, 2> const p2 = { env.MaxX, env.MaxY };
+
+	want_all			want;
+	query_visitor<Area>		qvisitor{list, want};
+	rtree->intersectsWithQuery(si::Region(si::Point(p1.data(), p1.size()),
+			si::Point(p2.data(), p2.size())), qvisitor);
+}
+
+/*
+ * Take over an area assembled by another index. The geometry still
+ * references the spatial reference of that index which may go away.
+ */
+void AreaIndex::adopt(Area *area) {
+	const_cast<OGRGeometry *>(area->geometry)->assignSpatialReference(&oSRS);
+
+	area->neighbours.clear();
+	if (withadjacency && !area->rings.empty())
+		adjacency(area);
+
+	insert(area);
+	append(area);
+}
+
+/* Add to arealist and the object index */
+void AreaIndex::append(Area *area) {
+	area->listpos=arealist.size();
+	arealist.push_back(area);
+
+	if (withobjects)
+		objectindex[objectkey_t(area->source, area->osm_id)].push_back(area);
+}
+
+/* Keep the object index from now on - for the query server */
+void AreaIndex::indexobjects(void ) {
+	withobjects=true;
+
+	objectindex.clear();
+	for(auto a : arealist)
+		objectindex[objectkey_t(a->source, a->osm_id)].push_back(a);
+}
+
+void AreaIndex::findobject(uint8_t source, osmium::object_id_type id, std::vector<Area*> *list) {
+	auto it=objectindex.find(objectkey_t(source, id));
+	if (it != objectindex.end())
+		list->insert(list->end(), it->second.begin(), it->second.end());
+}
+
+/* Drop an area from the index and adjacency - the caller deletes it */
+void AreaIndex::remove(Area *area) {
+	rtree->deleteData(region(area), (uint64_t) area);
+	profiler.forget(area);
+
+	/* Swap the last area into our slot - order does not matter anymore */
+	if (area->listpos < arealist.size() && arealist[area->listpos] == area) {
+		Area	*last=arealist.back();
+		arealist[area->listpos]=last;
+		last->listpos=area->listpos;
+		arealist.pop_back();
+	}
+
+	if (withobjects) {
+		auto oit=objectindex.find(objectkey_t(area->source, area->osm_id));
+		if (oit != objectindex.end()) {
+			std::vector<Area*>&	list=oit->second;
+			list.erase(std::remove(list.begin(), list.end(), area), list.end());
+			if (list.empty())
+				objectindex.erase(oit);
+		}
+	}
+
+	for(auto oa : area->neighbours) {
+		auto nit=std::find(oa->neighbours.begin(), oa->neighbours.end(), area);
+		if (nit != oa->neighbours.end())
+			oa->neighbours.erase(nit);
+	}
+
+	for(auto& ring : area->rings) {
+		for(auto& node : ring) {
+			auto nit=nodeindex.find(node.ref);
+			if (nit == nodeindex.end())
+				continue;
+
+			std::vector<Area*>&	list=nit->second;
+			list.erase(std::remove(list.begin(), list.end(), area), list.end());
+			if (list.empty())
+				nodeindex.erase(nit);
+		}
+	}
+}
+
 void AreaIndex::insert(Area *area) {
 	if (DEBUG)
 		std::cout << "Insert: " << area->id << std::endl;
 	rtree->insertData(0, nullptr, region(area), (uint64_t) area);
 }
 
+/* Read all wanted areas of filename into the index */
+void AreaIndex::load(const std::string& filename) {
+	osmium::io::File input_file{filename};
+
+	osmium::area::Assembler::config_type assembler_config;
+
+	osmium::TagsFilter areafilter{false};
+	areafilter.add_rule(true, osmium::TagMatcher{osmium::StringMatcher::equal{"landuse"}});
+	areafilter.add_rule(true, osmium::TagMatcher{osmium::StringMatcher::equal{"natural"}});
+	areafilter.add_rule(true, osmium::TagMatcher{osmium::StringMatcher::equal{"building"}});
+	areafilter.add_rule(true, osmium::TagMatcher{osmium::StringMatcher::equal{"amenity"}});
+	areafilter.add_rule(true, osmium::TagMatcher{osmium::StringMatcher::equal{"leisure"}});
+	areafilter.add_rule(true, osmium::TagMatcher{osmium::StringMatcher::equal{"man_made"}});
+	osmium::area::MultipolygonManager<osmium::area::Assembler> areamp_manager{assembler_config, areafilter};
+
+	// We read the input file twice. In the first pass, only relations are
+	// read and fed into the multipolygon manager.
+	stats.start("relations");
+	osmium::relations::read_relations(input_file, areamp_manager);
+	stats.stop("relations");
+
+	index_type index;
+	location_handler_type location_handler{index};
+	location_handler.ignore_errors();
+
+	stats.start("areas");
+	osmium::io::Reader reader{input_file};
+	osmium::apply(reader, location_handler,
+		*this,
+		areamp_manager.handler([this](osmium::memory::Buffer&& buffer) {
+			osmium::apply(buffer, *this);
+		})
+	);
+	reader.close();
+	stats.stop("areas");
+	std::cerr << "Pass 2 done\n";
+
+	std::cerr << "Memory:\n";
+	osmium::relations::print_used_memory(std::cerr, areamp_manager.used_memory());
+}
+
+/*
+ * Record areas sharing boundary nodes as neighbours. We only do this
+ * for landuse and natural as buildings would blow up the node index
+ * for little gain.
+ */
+void AreaIndex::adjacency(Area *area) {
+	std::unordered_set<Area*>	seen;
+
+	for(auto& ring : area->rings) {
+		for(auto& node : ring) {
+			std::vector<Area*>&	list=nodeindex[node.ref];
+
+			/* Closing node or node used twice by ourselves */
+			if (!list.empty() && list.back() == area)
+				continue;
+
+			for(auto oa : list) {
+				if (!seen.insert(oa).second)
+					continue;
+				oa->neighbours.push_back(area);
+				area->neighbours.push_back(oa);
+			}
+
+			list.push_back(area);
+		}
+	}
+}
+
+/*
+ * Neighbours are known once all areas are in. Only adding areas later
+ * on needs the node index, and areas without glued neighbours never
+ * look at their boundary again.
+ */
+void AreaIndex::dropnodeindex(void ) {
+	std::unordered_map<osmium::object_id_type, std::vector<Area*>>().swap(nodeindex);
+
+	for(auto a : arealist)
+		if (a->neighbours.empty())
+			a->dropboundary();
+}
+
+/* Hilbert curve distance of x/y on a 2^16 x 2^16 grid */
+static uint32_t hilbertkey(uint32_t x, uint32_t y) {
+	uint32_t	d=0;
+
+	for(uint32_t s=1<<15;s>0;s>>=1) {
+		uint32_t	rx=(x & s) > 0;
+		uint32_t	ry=(y & s) > 0;
+
+		d+=s*s*((3*rx)^ry);
+
+		if (ry == 0) {
+			if (rx == 1) {
+				x=s-1-x;
+				y=s-1-y;
+			}
+			std::swap(x, y);
+		}
+	}
+
+	return d;
+}
+
+/*
+ * Order areas along a Hilbert curve over their envelope centres so
+ * spatial neighbours are processed one after another. Ids, geometry
+ * allocations and the R-tree are rebuilt in that order.
+ */
+void AreaIndex::hilbertsort(void ) {
+	OGREnvelope	extent;
+
+	if (arealist.empty())
+		return;
+
+	arealist.front()->envelope(extent);
+	for(auto a : arealist) {
+		OGREnvelope	env;
+		a->envelope(env);
+		extent.Merge(env);
+	}
+
+	double	width=std::max(extent.MaxX-extent.MinX, 1e-9);
+	double	height=std::max(extent.MaxY-extent.MinY, 1e-9);
+
+	std::vector<std::pair<uint32_t, Area*>>	keyed;
+	keyed.reserve(arealist.size());
+
+	for(auto a : arealist) {
+		OGREnvelope	env;
+		a->envelope(env);
+
+		uint32_t	x=((env.MinX+env.MaxX)/2-extent.MinX)/width*65535;
+		uint32_t	y=((env.MinY+env.MaxY)/2-extent.MinY)/height*65535;
+
+		keyed.push_back(std::make_pair(hilbertkey(x, y), a));
+	}
+
+	std::stable_sort(keyed.begin(), keyed.end(),
+		[](const std::pair<uint32_t, Area*>& l, const std::pair<uint32_t, Area*>& r) {
+			return l.first < r.first;
+		});
+
+	arealist.clear();
+	for(auto& k : keyed) {
+		Area	*a=k.second;
+
+		/* Reallocate so the geometry heap follows the new order */
+		const OGRGeometry	*old=a->geometry;
+		a->geometry=old->clone();
+		delete(old);
+
+		a->id=arealist.size();
+		a->listpos=arealist.size();
+		arealist.push_back(a);
+	}
+
+	bulkload();
+}
+
 // This callback is called by osmium::apply for each area in the data.
 void AreaIndex::area(const osmium::Area& area) {
 	try {
@@ -78,17 +435,36 @@ void AreaIndex::area(const osmium::Area& area) {
 		geom->assignSpatialReference(&oSRS);
 		Area	*a=new Area{std::move(geom), src, area};
 
+		if (withadjacency && (a->osm_type == AREA_LANDUSE || a->osm_type == AREA_NATURAL)) {
+			a->addrings(area);
+			adjacency(a);
+		}
+
+		if (giant_threshold && SegmentIndex::numpoints(a->geometry) >= giant_threshold)
+			a->buildsegmentindex();
+
 		insert(a);
-		arealist.push_back(a);
+		append(a);
+
+		if (stats.on())
+			stats.count(std::string("areas.")+a->osm_key);
+		if (a->segindex)
+			stats.count("areas.giant");
 	} catch (const osmium::geometry_error& e) {
+		stats.count("errors.geometry");
 		std::cerr << "GEOMETRY ERROR: " << e.what() << "\n";
 	} catch (const osmium::invalid_location& e) {
+		stats.count("errors.location");
 		std::cerr << "Invalid location way id " << area.orig_id() << std::endl;
 	}
 }
 
 void AreaIndex::foreach(AreaProcess& compare) {
+	size_t		done=0;
+
 	for(auto ma : arealist) {
+		stats.progress(compare.Name(), done++, arealist.size());
+
 		if (!compare.WantA(ma))
 			continue;
 
@@ -100,7 +476,11 @@ void AreaIndex::processoverlap(AreaCompare& compare) {
 	std::vector<Area*>	list;
 	list.reserve(100);
 
+	size_t			candidates=stats.counter(std::string(compare.Name())+".candidates");
+	size_t			done=0;
+
 	for(auto ma : arealist) {
+		stats.progress(compare.Name(), done++, arealist.size());
 
 		if (!compare.WantA(ma))
 			continue;
@@ -109,6 +489,8 @@ void AreaIndex::processoverlap(AreaCompare& compare) {
 			std::cout << "Checking overlap for " << ma->osm_id << std::endl;
 
 		findoverlapping(ma, &list, compare);
+		stats.count(candidates, list.size());
+		profiler.candidates(ma, list.size());
 
 		for(auto oa : list) {
 			if (DEBUG)
@@ -120,3 +502,27 @@ void AreaIndex::processoverlap(AreaCompare& compare) {
 		list.clear();
 	}
 }
+
+/*
+ * Run compare for a subset of areas only. Pairs with a partner outside
+ * the subset are tried both ways round so the id ordering in the
+ * checks still sees every pair exactly like a full run.
+ */
+void AreaIndex::processoverlap(AreaCompare& compare, std::vector<Area*>& subset) {
+	std::unordered_set<Area*>	in(subset.begin(), subset.end());
+	std::vector<Area*>		list;
+	want_all			want;
+
+	for(auto ma : subset) {
+		findoverlapping(ma, &list, want);
+
+		for(auto oa : list) {
+			if (compare.WantA(ma) && compare.WantB(oa))
+				compare.Overlaps(ma, oa);
+			if (!in.count(oa) && compare.WantA(oa) && compare.WantB(ma))
+				compare.Overlaps(oa, ma);
+		}
+
+		list.clear();
+	}
+}
@@ -1,12 +1,26 @@
+#ifndef AREAINDEX_HPP
+#define AREAINDEX_HPP
+
 #include <osmium/handler.hpp>
 #include <SpatialIndex.h>
 #include <osmium/geom/ogr.hpp>
+#include <unordered_map>
 
 #include "SpatiaLiteWriter.hpp"
 #include "AreaCheck.hpp"
 
 namespace si = SpatialIndex;
 
+typedef std::pair<uint8_t, osmium::object_id_type>	objectkey_t;
+
+class objectkey_hash {
+	public:
+	size_t operator()(const objectkey_t& k) const {
+		std::hash<osmium::object_id_type>	h;
+		return h(k.second)*2+k.first;
+	}
+};
+
 class AreaIndex : public osmium::handler::Handler{
 	si::ISpatialIndex	*rtree;
 	si::IStorageManager	*sm;
@@ -17,20 +31,47 @@ class AreaIndex : public osmium::handler::Handler{
 	uint32_t const dimension = 2;
 	double const fill_factor = 0.5;
 
-	typedef std::array<double, 2> coord_array_t;
 	int64_t		id=0;
+	size_t		giant_threshold=20000;
+	bool		withadjacency=true;
+	bool		withobjects=false;
 
 	osmium::geom::OGRFactory<>	m_factory;
 	OGRSpatialReference		oSRS;
+
+	/* Boundary node id to areas using it - for glued neighbours */
+	std::unordered_map<osmium::object_id_type, std::vector<Area*>>	nodeindex;
+
+	/* OSM object to its areas - only kept for lookups by the server */
+	std::unordered_map<objectkey_t, std::vector<Area*>, objectkey_hash>	objectindex;
 public:
 	std::vector<Area*>			arealist;
 private:
 	si::Region region(Area *area);
+	void adjacency(Area *area);
+	void append(Area *area);
 public:
 	AreaIndex();
+	~AreaIndex();
+	void setgiant(size_t threshold);
+	size_t giant(void ) const;
+	void setadjacency(bool enable);
+	bool adjacencyenabled(void ) const;
+	void load(const std::string& filename);
+	void dropnodeindex(void );
+	void indexobjects(void );
+	void findobject(uint8_t source, osmium::object_id_type id, std::vector<Area*> *list);
 	void findoverlapping(Area *area, std::vector<Area*> *list, AreaWant& want);
 	void insert(Area *area);
+	void bulkload(void );
+	void hilbertsort(void );
 	void area(const osmium::Area& area);
 	void foreach(AreaProcess& compare);
 	void processoverlap(AreaCompare& compare);
+	void processoverlap(AreaCompare& compare, std::vector<Area*>& subset);
+	void findregion(const OGREnvelope& env, std::vector<Area*> *list);
+	void adopt(Area *area);
+	void remove(Area *area);
 };
+
+#endif
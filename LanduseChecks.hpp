@@ -0,0 +1,388 @@
+#ifndef LANDUSECHECKS_HPP
+#define LANDUSECHECKS_HPP
+
+#include <cmath>
+#include <memory>
+#include <strings.h>
+#include <boost/format.hpp>
+
+#include "Area.hpp"
+#include "AreaCheck.hpp"
+#include "SpatiaLiteWriter.hpp"
+#include "Stats.hpp"
+#include "Profiler.hpp"
+
+#define DEBUG 0
+
+class AreaOverlapCompare : public AreaCompare {
+	size_t	evaluations=stats.counter("overlap.evaluations");
+	size_t	positives=stats.counter("overlap.positives");
+
+	public:
+		AreaOverlapCompare(SpatiaLiteWriter& writer) : AreaCompare(writer) {
+			writer.addAreaOverlapLayer("overlap");
+			writer.addAreaOverlapLayer("natural");
+		};
+
+		virtual const char *Name() const {
+			return "overlap";
+		}
+
+		virtual bool WantA(Area *a) const {
+			if (a->osm_type == AREA_LANDUSE
+				|| a->osm_type == AREA_NATURAL)
+				return true;
+			return false;
+		}
+
+		virtual bool WantB(Area *a) const {
+			return WantA(a);
+		}
+
+		virtual void Overlaps(Area *a, Area *b) const {
+			/*
+			 * Overlapping ourselves or an id smaller than ours
+			 * We only want to check a -> b not b -> a again as they
+			 * will overlap too anyway.
+			 */
+			if ((a->id >= b->id))
+				return;
+
+			if (a->osm_type != AREA_LANDUSE
+				&& a->osm_type != AREA_NATURAL)
+				return;
+
+			if (b->osm_type != AREA_LANDUSE
+				&& b->osm_type != AREA_NATURAL)
+				return;
+
+			stats.count(evaluations);
+			if (a->overlaps(b)) {
+				stats.count(positives);
+				if (a->osm_type == AREA_NATURAL || b->osm_type == AREA_NATURAL)
+					writer.write_overlap(a, b, "natural");
+				else
+					writer.write_overlap(a, b, "overlap");
+				return;
+			}
+
+			return;
+		}
+};
+
+class AmenityIntersect : public AreaCompare {
+	size_t	evaluations=stats.counter("hierarchy.evaluations");
+	size_t	positives=stats.counter("hierarchy.positives");
+
+	public:
+		AmenityIntersect(SpatiaLiteWriter& writer) : AreaCompare(writer) {
+			writer.addAreaOverlapLayer("hierarchy");
+		};
+
+		virtual const char *Name() const {
+			return "hierarchy";
+		}
+
+		virtual bool WantA(Area *a) const {
+			if (a->osm_type == AREA_NATURAL) {
+				if (strcasecmp(a->osm_value, "mountain_range") == 0)
+					return false;
+				return true;
+			}
+			if (a->osm_type == AREA_LANDUSE)
+				return true;
+			if (a->osm_type == AREA_AMENITY)
+				return true;
+			if (a->osm_type == AREA_MANMADE) {
+
+				/* Overlapping types - by default */
+				if (strcasecmp(a->osm_value, "pier") == 0)
+					return false;
+				if (strcasecmp(a->osm_value, "bridge") == 0)
+					return false;
+
+				return true;
+			}
+			if (a->osm_type == AREA_LEISURE) {
+				if (strcasecmp(a->osm_value, "nature_reserve") == 0)
+					return false;
+				return true;
+			}
+			if (a->osm_type == AREA_BUILDING) {
+				return true;
+			}
+			return false;
+		}
+
+		bool WantB(Area *a) const {
+			return WantA(a);
+		}
+
+		void Overlaps(Area *a, Area *b) const {
+			/*
+			 * Overlapping ourselves or an id smaller than ours
+			 * We only want to check a -> b not b -> a again as they
+			 * will overlap too anyway.
+			 */
+			if ((a->id >= b->id) &&
+				(a->osm_type == b->osm_type))
+				return;
+
+			if (DEBUG)
+				std::cout << "Overlaps " << std::endl
+					<< "A Id: " << a->osm_id
+					<< "A Type: " << a->osm_key
+					<< "B Id: " << b->osm_id
+					<< "B Type: " << b->osm_key
+					<< std::endl;
+
+			/* One of them needs to be an AMENITY */
+			if (!((WantA(a) && WantB(b))
+				|| (WantA(b) && WantB(a))))
+				return;
+
+			if (DEBUG)
+				std::cout << "Checking for intersection" << std::endl;
+
+			stats.count(evaluations);
+			if (a->intersects(b)) {
+				stats.count(positives);
+
+				/* if a builing overlaps something - check layers */
+				if (a->osm_type == AREA_BUILDING
+					|| b->osm_type == AREA_BUILDING) {
+
+					if (a->osm_layer != b->osm_layer) {
+						return;
+					}
+				}
+
+				writer.write_overlap(a, b, "hierarchy");
+				return;
+			}
+
+			return;
+		}
+};
+
+/*
+ * Glued neighbours which nearly but not exactly share their boundary.
+ * Only walks the adjacency from the node index, no geometry library.
+ */
+class GluedGap : public AreaProcess {
+	size_t	evaluations=stats.counter("gap.evaluations");
+	size_t	positives=stats.counter("gap.positives");
+	double	tolerance=1.0;
+
+	public:
+		GluedGap(SpatiaLiteWriter& writer) : AreaProcess(writer) {
+			writer.addAreaOverlapLayer("gap");
+		}
+
+		const char *Name() const {
+			return "gap";
+		}
+
+		bool WantA(Area *a) const {
+			if (a->osm_type == AREA_LANDUSE
+				|| a->osm_type == AREA_NATURAL)
+				return true;
+			return false;
+		}
+
+		bool WantB(Area *a) const {
+			return WantA(a);
+		}
+
+		void Process(Area *a) const {
+			for(auto oa : a->neighbours) {
+				if (a->id >= oa->id)
+					continue;
+
+				double	x, y;
+				stats.count(evaluations);
+				if (a->gluedgap(oa, tolerance, x, y)
+					|| oa->gluedgap(a, tolerance, x, y)) {
+					stats.count(positives);
+					writer.write_gap(a, oa, x, y, "gap");
+				}
+			}
+		}
+};
+
+/*
+ * WGS84 to Gauss-Krüger zone 3. Setting up the PROJ transformation is
+ * expensive so it is done once per thread and reused for every area
+ * and every batch job, transformTo would build a new one per call.
+ * Returns nullptr when PROJ is unable to set it up.
+ */
+static OGRCoordinateTransformation *gk3transform(void ) {
+	thread_local std::unique_ptr<OGRCoordinateTransformation>	ct;
+
+	if (!ct) {
+		OGRSpatialReference	sSRS, tSRS;
+		sSRS.importFromEPSG(4326);
+		tSRS.importFromEPSG(31467);
+		ct.reset(OGRCreateCoordinateTransformation(&sSRS, &tSRS));
+	}
+
+	return ct.get();
+}
+
+class LanduseSize : public AreaProcess {
+	size_t	evaluations=stats.counter("size.evaluations");
+	OGRCoordinateTransformation	*ct;
+
+	public:
+		LanduseSize(SpatiaLiteWriter& writer) : AreaProcess(writer), ct(gk3transform()) {
+			writer.addAreaLayer("huge");
+			writer.addAreaLayer("suspicious");
+			writer.addAreaLayer("complex");
+
+			if (!ct)
+				std::cerr << "Error: no transformation from EPSG:4326 to EPSG:31467 - skipping size checks" << std::endl;
+		}
+
+		const char *Name() const {
+			return "size";
+		}
+
+		bool WantA(Area *a) const {
+			if (a->osm_type == AREA_LANDUSE)
+				return true;
+			return false;
+		}
+
+		bool WantB(Area *a) const {
+			return WantA(a);
+		}
+
+		float polygon_area(OGRGeometry *geom) const {
+			switch(geom->getGeometryType()) {
+				case(wkbPolygon): {
+					return static_cast<const OGRPolygon*>(geom)->get_Area();
+				}
+				case(wkbMultiPolygon): {
+					return static_cast<const OGRMultiPolygon*>(geom)->get_Area();
+				}
+				default: {
+					break;
+				};
+			}
+			return 0;
+		}
+
+		double distance(const OGRPoint& a, const OGRPoint& b) const {
+			return a.Distance((OGRGeometry *)&b);
+		}
+
+		double polygon_complexity(const OGRGeometry *geom) const {
+			double			complexity=0;
+
+			switch(geom->getGeometryType()) {
+				case(wkbLineString): {
+					const OGRLineString	*ring=static_cast<const OGRLineString*>(geom);
+					int numpoints=ring->getNumPoints();
+
+					// Summe der innenwinkel im dreieck
+					if (numpoints <= 3)
+						return 180;
+					// Summe der innenwinkel im rechteck
+					if (numpoints == 4)
+						return 360;
+
+					if (DEBUG)
+						std::cout << "Looping on points" << std::endl;
+
+					for(int i=0;i<numpoints;i++) {
+						OGRPoint	Pa,Pb,Pc;
+
+						ring->getPoint(i%(numpoints-1), &Pa);
+						ring->getPoint((i+1)%(numpoints-1), &Pb);
+						ring->getPoint((i+2)%(numpoints-1), &Pc);
+
+						double a=distance(Pa, Pb);
+						double b=distance(Pb, Pc);
+						double c=distance(Pc, Pa);
+
+						double rad=acos((a*a+b*b-c*c)/(2*a*b));
+						double angle=rad*(180/3.1415926);
+
+						if (DEBUG) {
+							std::cout
+								<< " Pa.X " << Pa.getX()
+								<< " Pa.Y " << Pa.getY()
+								<< " a " << a
+								<< " b " << c
+								<< " c " << a
+								<< " rad " << rad
+								<< " angle " << angle
+								<< std::endl;
+						}
+
+						complexity+=(180-angle);
+					}
+					break;
+				}
+				case(wkbPolygon): {
+					const OGRLinearRing	*lr=static_cast<const OGRPolygon*>(geom)->getExteriorRing();
+					complexity+=polygon_complexity(lr);
+					break;
+				}
+				case(wkbMultiPolygon): {
+					const OGRMultiPolygon *mp=static_cast<const OGRMultiPolygon*>(geom);
+					int numgeom=mp->getNumGeometries();
+
+					for(int i=0;i<numgeom;i++) {
+						const OGRGeometry *subgeom=mp->getGeometryRef(i);
+						complexity+=polygon_complexity(subgeom);
+					}
+					break;
+				}
+				default: {
+					std::cout << "Unknown geometry type " << geom->getGeometryName()
+						<< "(" << geom->getGeometryType() << ")" << std::endl;
+				};
+			}
+
+			return complexity;
+		}
+
+		void Process(Area *a) const {
+			ProfileScope	profile{"size", a};
+
+			if (!ct)
+				return;
+
+			stats.count(evaluations);
+
+			OGRGeometry	*geom=a->geometry->clone();
+			geom->transform(ct);
+
+			double complexity=polygon_complexity(geom);
+			if (complexity > 2000) {
+				std::string s=boost::str(boost::format("Complexity %1$.1f") % complexity);
+				writer.writeAreaLayer("complex", a, "complex", s.c_str());
+			}
+
+			float areasize=polygon_area(geom);
+
+			if (areasize < 40) {
+				std::string s=boost::str(boost::format("Small landuse  %1$.2fm² below 40m²") % areasize);
+				writer.writeAreaLayer("suspicious", a, "lsize1", s.c_str());
+			} else if (areasize < 100) {
+				std::string s=boost::str(boost::format("Small landuse  %1$.2fm² below 100m²") % areasize);
+				writer.writeAreaLayer("suspicious", a, "lsize2", s.c_str());
+			} else if (areasize > 400000) {
+				std::string s=boost::str(boost::format("Huge landuse %1$.0fm² > 400000m²") % areasize);
+				writer.writeAreaLayer("huge", a, "huge2", s.c_str());
+			} else if (areasize > 200000) {
+				std::string s=boost::str(boost::format("Large landuse %1$.0fm² > 200000m²") % areasize);
+				writer.writeAreaLayer("huge", a, "huge1", s.c_str());
+			}
+
+			delete(geom);
+		}
+};
+
+#endif
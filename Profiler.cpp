@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <iomanip>
+
+#include "Profiler.hpp"
+#include "SegmentIndex.hpp"
+
+thread_local Profiler	profiler;
+
+void Profiler::enable(uint32_t samplerate) {
+	enabled=true;
+	rate=std::max<uint32_t>(1, samplerate);
+}
+
+bool Profiler::sample(void ) {
+	if (!enabled)
+		return false;
+
+	if (++tick < rate)
+		return false;
+
+	tick=0;
+	return true;
+}
+
+/* Sampled costs are scaled up by the sample rate */
+void Profiler::record(const char *what, Area *a, Area *b, double seconds) {
+	double	cost=seconds*rate;
+
+	AreaCost&	ac=areas[a];
+	ac.seconds+=cost;
+	ac.calls+=rate;
+
+	if (!b)
+		return;
+
+	AreaCost&	bc=areas[b];
+	bc.seconds+=cost;
+	bc.calls+=rate;
+
+	/* Many cheap calls add up as well - the cutoff is applied on report */
+	PairCost&	pc=pairs[(a < b) ? pairkey_t(a, b) : pairkey_t(b, a)];
+	pc.seconds+=cost;
+	pc.calls+=rate;
+	if (std::find(pc.whats.begin(), pc.whats.end(), what) == pc.whats.end())
+		pc.whats.push_back(what);
+}
+
+void Profiler::candidates(Area *a, size_t n) {
+	if (enabled)
+		areas[a].candidates+=n;
+}
+
+/* The area is about to be deleted - drop everything referencing it */
+void Profiler::forget(Area *a) {
+	if (!enabled)
+		return;
+
+	areas.erase(a);
+	for(auto it=pairs.begin();it != pairs.end();) {
+		if (it->first.first == a || it->first.second == a)
+			it=pairs.erase(it);
+		else
+			++it;
+	}
+}
+
+static void describe(std::ostream& out, Area *a) {
+	out << a->source_string() << " " << a->osm_id
+		<< " " << a->osm_key << "=" << a->osm_value;
+}
+
+void Profiler::report(std::ostream& out, size_t top) {
+	if (!enabled)
+		return;
+
+	std::vector<std::pair<Area*, AreaCost>>	list(areas.begin(), areas.end());
+
+	top=std::min(top, list.size());
+	std::partial_sort(list.begin(), list.begin()+top, list.end(),
+		[](const std::pair<Area*, AreaCost>& l, const std::pair<Area*, AreaCost>& r) {
+			return l.second.seconds > r.second.seconds;
+		});
+
+	out << std::fixed << std::setprecision(3);
+	out << "Most expensive areas:" << std::endl;
+	for(size_t i=0;i<top;i++) {
+		Area		*a=list[i].first;
+		AreaCost&	c=list[i].second;
+
+		out << "\t";
+		describe(out, a);
+		out << " vertices " << SegmentIndex::numpoints(a->geometry)
+			<< " candidates " << c.candidates
+			<< " calls " << c.calls
+			<< " seconds " << c.seconds
+			<< std::endl;
+	}
+
+	std::vector<std::pair<pairkey_t, PairCost>>	plist;
+	for(auto& p : pairs)
+		if (p.second.seconds >= pairmin)
+			plist.push_back(p);
+
+	size_t	ptop=std::min(top, plist.size());
+	std::partial_sort(plist.begin(), plist.begin()+ptop, plist.end(),
+		[](const std::pair<pairkey_t, PairCost>& l, const std::pair<pairkey_t, PairCost>& r) {
+			return l.second.seconds > r.second.seconds;
+		});
+
+	out << "Most expensive pairs:" << std::endl;
+	for(size_t i=0;i<ptop;i++) {
+		PairCost&	c=plist[i].second;
+
+		out << "\t";
+		for(size_t w=0;w<c.whats.size();w++)
+			out << (w ? "+" : "") << c.whats[w];
+		out << " ";
+		describe(out, plist[i].first.first);
+		out << " / ";
+		describe(out, plist[i].first.second);
+		out << " calls " << c.calls
+			<< " seconds " << c.seconds << std::endl;
+	}
+}
+
+ProfileScope::ProfileScope(const char *what, Area *a, Area *b) :
+		what(what), a(a), b(b), active(profiler.sample()) {
+
+	if (active)
+		start=std::chrono::steady_clock::now();
+}
+
+ProfileScope::~ProfileScope() {
+	if (!active)
+		return;
+
+	double	seconds=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+	profiler.record(what, a, b, seconds);
+}
@@ -0,0 +1,72 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <chrono>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+#include "Area.hpp"
+
+/*
+ * Optional per object cost accounting. Every sample'th call of a
+ * profiled function is timed and charged to the areas involved and
+ * to the pair. Reports the most expensive OSM objects and the pairs
+ * above a minimum total cost at the end.
+ */
+class Profiler {
+	class AreaCost {
+		public:
+		double				seconds=0;
+		uint64_t			calls=0;
+		uint64_t			candidates=0;
+	};
+
+	class PairCost {
+		public:
+		double				seconds=0;
+		uint64_t			calls=0;
+		/* Distinct profiled functions - only a handful exist */
+		std::vector<const char *>	whats;
+	};
+
+	typedef std::pair<Area*, Area*>	pairkey_t;
+
+	class pairkey_hash {
+		public:
+		size_t operator()(const pairkey_t& k) const {
+			std::hash<Area*>	h;
+			return h(k.first)*31+h(k.second);
+		}
+	};
+
+	bool					enabled=false;
+	uint32_t				rate=1;
+	uint32_t				tick=0;
+	double					pairmin=0.001;
+
+	std::unordered_map<Area*, AreaCost>	areas;
+	std::unordered_map<pairkey_t, PairCost, pairkey_hash>	pairs;
+	public:
+	void enable(uint32_t samplerate);
+	bool sample(void );
+	void record(const char *what, Area *a, Area *b, double seconds);
+	void candidates(Area *a, size_t n);
+	void forget(Area *a);
+	void report(std::ostream& out, size_t top);
+};
+
+extern thread_local Profiler	profiler;
+
+class ProfileScope {
+	const char					*what;
+	Area						*a;
+	Area						*b;
+	bool						active;
+	std::chrono::steady_clock::time_point		start;
+	public:
+	ProfileScope(const char *what, Area *a, Area *b=nullptr);
+	~ProfileScope();
+};
+
+#endif
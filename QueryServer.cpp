@@ -0,0 +1,560 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "QueryServer.hpp"
+
+#define DEBUG	0
+
+/* Collects the finding ids of an R-tree query */
+class finding_visitor : public si::IVisitor {
+	std::vector<uint64_t>&	list;
+
+	public:
+
+	finding_visitor(std::vector<uint64_t>& l) : list(l) {}
+
+	void visitNode(si::INode const&) {
+	}
+
+	void visitData(si::IData const& d) {
+		list.push_back(d.getIdentifier());
+	}
+
+	void visitData(std::vector<si::IData const*>&) {
+	}
+};
+
+static si::Region envregion(const OGREnvelope& env) {
+	std::array<double, 2> const p1 = { env.MinX, env.MinY };
+	std::array<double, 2> const p2 = { env.MaxX, env.MaxY };
+
+	return si::Region(si::Point(p1.data(), p1.size()),
+			si::Point(p2.data(), p2.size()));
+}
+
+QueryServer::QueryServer(AreaIndex& index, SpatiaLiteWriter& writer) :
+		index(index), writer(writer) {
+
+	fsm=si::StorageManager::createNewMemoryStorageManager();
+	frtree=si::RTree::createNewRTree(*fsm, 0.5, 100, 100, 2, si::RTree::RV_LINEAR, frtree_id);
+
+	index.indexobjects();
+
+	writer.setObserver([this](const char *layer, Area *a, Area *b, const char *message) {
+		record(layer, a, b, message);
+	});
+}
+
+QueryServer::~QueryServer() {
+	delete(frtree);
+	delete(fsm);
+}
+
+void QueryServer::addcheck(AreaProcess *process) {
+	processes.push_back(process);
+}
+
+void QueryServer::addcheck(AreaCompare *compare) {
+	compares.push_back(compare);
+}
+
+void QueryServer::record(const char *layer, Area *a, Area *b, const char *message) {
+	if (filter && !filter->count(a) && !(b && filter->count(b)))
+		return;
+
+	Finding		f;
+	f.layer=layer;
+	f.a=a;
+	f.b=b;
+	f.message=message ? message : "";
+
+	a->envelope(f.env);
+	if (b) {
+		OGREnvelope	benv;
+		b->envelope(benv);
+		f.env.Merge(benv);
+	}
+
+	uint64_t	fid=nextfinding++;
+
+	frtree->insertData(0, nullptr, envregion(f.env), fid);
+	byarea[a].push_back(fid);
+	if (b && b != a)
+		byarea[b].push_back(fid);
+
+	findings.emplace(fid, std::move(f));
+}
+
+/* Drop all findings involving one of the areas */
+void QueryServer::forget(const std::unordered_set<Area*>& areas) {
+	for(auto a : areas) {
+		auto it=byarea.find(a);
+		if (it == byarea.end())
+			continue;
+
+		std::vector<uint64_t>	ids;
+		ids.swap(it->second);
+		byarea.erase(it);
+
+		for(auto fid : ids)
+			forget(fid, a);
+	}
+}
+
+/* Drop one finding of area - also from the list of the other area */
+void QueryServer::forget(uint64_t fid, Area *area) {
+	auto it=findings.find(fid);
+
+	/* Already gone via the other area */
+	if (it == findings.end())
+		return;
+
+	Finding&	f=it->second;
+	Area		*other=(f.a == area) ? f.b : f.a;
+
+	if (other && other != area) {
+		auto oit=byarea.find(other);
+		if (oit != byarea.end()) {
+			std::vector<uint64_t>&	list=oit->second;
+			list.erase(std::remove(list.begin(), list.end(), fid), list.end());
+			if (list.empty())
+				byarea.erase(oit);
+		}
+	}
+
+	frtree->deleteData(envregion(f.env), fid);
+	findings.erase(it);
+}
+
+/*
+ * Re-run all checks for the subset. Processes also run on the glued
+ * neighbours as the gap check only reports each pair from the lower id.
+ */
+void QueryServer::recheck(std::vector<Area*>& subset) {
+	std::unordered_set<Area*>	in(subset.begin(), subset.end());
+	std::unordered_set<Area*>	processed;
+
+	forget(in);
+	filter=&in;
+
+	for(auto p : processes) {
+		processed.clear();
+		for(auto a : subset) {
+			if (processed.insert(a).second && p->WantA(a))
+				p->Process(a);
+			for(auto oa : a->neighbours)
+				if (processed.insert(oa).second && p->WantA(oa))
+					p->Process(oa);
+		}
+	}
+
+	for(auto c : compares)
+		index.processoverlap(*c, subset);
+
+	filter=nullptr;
+}
+
+std::vector<Area*> QueryServer::lookup(const std::string& type, osmium::object_id_type id) {
+	std::vector<Area*>	list;
+
+	if (type == "way")
+		index.findobject(SRC_WAY, id, &list);
+	else if (type == "relation")
+		index.findobject(SRC_RELATION, id, &list);
+
+	return list;
+}
+
+/* Merge the envelope of a - OGREnvelope has no usable empty state */
+static void grow(OGREnvelope& env, bool& empty, Area *a) {
+	OGREnvelope	aenv;
+	a->envelope(aenv);
+	if (empty)
+		env=aenv;
+	else
+		env.Merge(aenv);
+	empty=false;
+}
+
+bool QueryServer::envelope(std::istream& in, OGREnvelope& env) {
+	in >> env.MinX >> env.MinY >> env.MaxX >> env.MaxY;
+	return !in.fail();
+}
+
+static std::string jsonstring(const std::string& s) {
+	std::ostringstream	o;
+
+	o << '"';
+	for(auto c : s) {
+		switch(c) {
+			case '"': o << "\\\""; break;
+			case '\\': o << "\\\\"; break;
+			case '\n': o << "\\n"; break;
+			case '\t': o << "\\t"; break;
+			default:
+				if ((unsigned char) c < 0x20)
+					o << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int) c << std::dec;
+				else
+					o << c;
+		}
+	}
+	o << '"';
+
+	return o.str();
+}
+
+static void jsonarea(std::ostream& out, Area *a) {
+	out << "{\"type\":\"" << a->source_string() << "\""
+		<< ",\"id\":" << a->osm_id
+		<< ",\"key\":" << jsonstring(a->osm_key)
+		<< ",\"value\":" << jsonstring(a->osm_value)
+		<< "}";
+}
+
+static void jsonfinding(std::ostream& out, const Finding& f) {
+	out << "{\"layer\":" << jsonstring(f.layer)
+		<< ",\"a\":";
+	jsonarea(out, f.a);
+	if (f.b) {
+		out << ",\"b\":";
+		jsonarea(out, f.b);
+	}
+	out << ",\"message\":" << jsonstring(f.message)
+		<< ",\"bbox\":[" << std::setprecision(10)
+		<< f.env.MinX << "," << f.env.MinY << ","
+		<< f.env.MaxX << "," << f.env.MaxY << "]}" << std::endl;
+}
+
+/* bbox minx miny maxx maxy - findings intersecting the box */
+void QueryServer::cmd_bbox(std::istream& in, std::ostream& out) {
+	OGREnvelope	env;
+
+	if (!envelope(in, env))
+		throw std::runtime_error("usage: bbox minx miny maxx maxy");
+
+	std::vector<uint64_t>	ids;
+	finding_visitor		visitor{ids};
+	frtree->intersectsWithQuery(envregion(env), visitor);
+
+	/* In the order they were found */
+	std::sort(ids.begin(), ids.end());
+	for(auto fid : ids)
+		jsonfinding(out, findings.at(fid));
+}
+
+/* object way|relation id - areas overlapping or intersecting the object */
+void QueryServer::cmd_object(std::istream& in, std::ostream& out) {
+	std::string		type;
+	osmium::object_id_type	id;
+
+	in >> type >> id;
+	if (in.fail())
+		throw std::runtime_error("usage: object way|relation id");
+
+	std::vector<Area*>	list;
+	for(auto a : lookup(type, id)) {
+		OGREnvelope	env;
+		a->envelope(env);
+		index.findregion(env, &list);
+
+		for(auto oa : list) {
+			if (oa == a)
+				continue;
+
+			const char	*relation=nullptr;
+			if (a->overlaps(oa))
+				relation="overlaps";
+			else if (a->intersects(oa))
+				relation="intersects";
+			else
+				continue;
+
+			out << "{\"relation\":\"" << relation << "\",\"a\":";
+			jsonarea(out, a);
+			out << ",\"b\":";
+			jsonarea(out, oa);
+			out << "}" << std::endl;
+		}
+
+		list.clear();
+	}
+}
+
+/* recheck minx miny maxx maxy - re-run all checks for areas in the box */
+void QueryServer::cmd_recheck(std::istream& in, std::ostream& out) {
+	OGREnvelope		env;
+	std::vector<Area*>	subset;
+
+	if (!envelope(in, env))
+		throw std::runtime_error("usage: recheck minx miny maxx maxy");
+
+	index.findregion(env, &subset);
+	recheck(subset);
+
+	out << "{\"areas\":" << subset.size() << "}" << std::endl;
+}
+
+/*
+ * update file - replace the areas of all objects in file and recheck
+ * their surroundings. Ways need their nodes in the file.
+ */
+void QueryServer::cmd_update(std::istream& in, std::ostream& out) {
+	std::string		filename;
+
+	in >> std::ws;
+	std::getline(in, filename);
+	if (filename.empty())
+		throw std::runtime_error("usage: update file");
+
+	AreaIndex		fresh;
+	fresh.setgiant(index.giant());
+	fresh.setadjacency(index.adjacencyenabled());
+	fresh.load(filename);
+
+	std::unordered_set<Area*>	old;
+	OGREnvelope			env;
+	bool				empty=true;
+
+	for(auto a : fresh.arealist) {
+		for(auto oa : lookup(a->source_string(), a->osm_id))
+			old.insert(oa);
+		grow(env, empty, a);
+	}
+
+	for(auto oa : old)
+		grow(env, empty, oa);
+
+	forget(old);
+	for(auto oa : old) {
+		index.remove(oa);
+		delete(oa);
+	}
+
+	for(auto a : fresh.arealist)
+		index.adopt(a);
+
+	size_t		added=fresh.arealist.size();
+	fresh.arealist.clear();
+
+	std::vector<Area*>	subset;
+	if (!empty) {
+		index.findregion(env, &subset);
+		recheck(subset);
+	}
+
+	out << "{\"removed\":" << old.size()
+		<< ",\"added\":" << added
+		<< ",\"rechecked\":" << subset.size() << "}" << std::endl;
+}
+
+/* delete way|relation id - drop the object and recheck its surroundings */
+void QueryServer::cmd_delete(std::istream& in, std::ostream& out) {
+	std::string		type;
+	osmium::object_id_type	id;
+
+	in >> type >> id;
+	if (in.fail())
+		throw std::runtime_error("usage: delete way|relation id");
+
+	std::vector<Area*>		list=lookup(type, id);
+	std::unordered_set<Area*>	old(list.begin(), list.end());
+	std::vector<Area*>		subset;
+	OGREnvelope			env;
+	bool				empty=true;
+
+	for(auto oa : list)
+		grow(env, empty, oa);
+
+	forget(old);
+	for(auto oa : list) {
+		index.remove(oa);
+		delete(oa);
+	}
+
+	if (!empty) {
+		index.findregion(env, &subset);
+		recheck(subset);
+	}
+
+	out << "{\"removed\":" << list.size()
+		<< ",\"rechecked\":" << subset.size() << "}" << std::endl;
+}
+
+/*
+ * One command per line. The answer is zero or more JSON lines
+ * followed by "OK <ms>" or "ERR <message>".
+ */
+std::string QueryServer::handle(const std::string& line) {
+	std::istringstream	in{line};
+	std::ostringstream	out;
+	std::string		cmd;
+	auto			start=std::chrono::steady_clock::now();
+
+	in >> cmd;
+
+	try {
+		if (cmd == "bbox")
+			cmd_bbox(in, out);
+		else if (cmd == "object")
+			cmd_object(in, out);
+		else if (cmd == "recheck")
+			cmd_recheck(in, out);
+		else if (cmd == "update")
+			cmd_update(in, out);
+		else if (cmd == "delete")
+			cmd_delete(in, out);
+		else if (cmd == "shutdown")
+			running=false;
+		else
+			throw std::runtime_error("unknown command " + cmd);
+	} catch(const std::exception& e) {
+		return std::string("ERR ") + e.what() + "\n";
+	}
+
+	out << "OK " << std::fixed << std::setprecision(3)
+		<< std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-start).count()
+		<< std::endl;
+
+	return out.str();
+}
+
+/* Write all of answer - false if the client went away */
+static bool sendall(int fd, const std::string& answer) {
+	size_t	done=0;
+
+	while(done < answer.size()) {
+		ssize_t	n=send(fd, answer.data()+done, answer.size()-done, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		done+=n;
+	}
+
+	return true;
+}
+
+/*
+ * Read what the client sent and answer all complete lines. Returns
+ * false when the client is to be dropped.
+ */
+bool QueryServer::client(int fd, std::string& buffer) {
+	char	chunk[4096];
+	ssize_t	n=read(fd, chunk, sizeof(chunk));
+
+	if (n < 0 && errno == EINTR)
+		return true;
+	if (n <= 0)
+		return false;
+
+	buffer.append(chunk, n);
+
+	size_t	pos;
+	while((pos=buffer.find('\n')) != std::string::npos) {
+		std::string	cmd=buffer.substr(0, pos);
+		buffer.erase(0, pos+1);
+
+		while(!cmd.empty() && cmd.back() == '\r')
+			cmd.pop_back();
+		if (cmd.empty())
+			continue;
+		if (cmd == "quit")
+			return false;
+
+		if (DEBUG)
+			std::cerr << "Query: " << cmd << std::endl;
+
+		if (!sendall(fd, handle(cmd)))
+			return false;
+	}
+
+	/* Not a command line but someone filling our memory */
+	return buffer.size() < 65536;
+}
+
+/*
+ * Answer all connected clients until a shutdown command. Commands are
+ * run one at a time, idle clients do not block others. Clients which
+ * stop reading their answers are dropped after a send timeout.
+ */
+void QueryServer::serve(const std::string& path) {
+	int	fd=socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		throw std::runtime_error(std::string("socket: ") + strerror(errno));
+
+	struct sockaddr_un	addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("socket path too long: " + path);
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+
+	unlink(path.c_str());
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+			|| listen(fd, 16) < 0) {
+		close(fd);
+		throw std::runtime_error("bind " + path + ": " + strerror(errno));
+	}
+
+	/* A client going away must not take the resident index with it */
+	signal(SIGPIPE, SIG_IGN);
+
+	std::cerr << "Listening on " << path << " with " << findings.size() << " findings" << std::endl;
+
+	std::vector<struct pollfd>	fds;
+	std::vector<std::string>	buffers;
+
+	fds.push_back({fd, POLLIN, 0});
+	buffers.push_back(std::string());
+
+	while(running) {
+		if (poll(fds.data(), fds.size(), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error(std::string("poll: ") + strerror(errno));
+		}
+
+		for(size_t i=fds.size();i-- > 1 && running;) {
+			if (!fds[i].revents)
+				continue;
+
+			if (!client(fds[i].fd, buffers[i])) {
+				close(fds[i].fd);
+				fds.erase(fds.begin()+i);
+				buffers.erase(buffers.begin()+i);
+			}
+		}
+
+		if (fds[0].revents & POLLIN) {
+			int	c=accept(fd, nullptr, nullptr);
+			if (c >= 0) {
+				struct timeval	tv={5, 0};
+				setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+				fds.push_back({c, POLLIN, 0});
+				buffers.push_back(std::string());
+			}
+		}
+	}
+
+	for(size_t i=1;i<fds.size();i++)
+		close(fds[i].fd);
+
+	close(fd);
+	unlink(path.c_str());
+}
@@ -0,0 +1,69 @@
+#ifndef QUERYSERVER_HPP
+#define QUERYSERVER_HPP
+
+#include <istream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "Area.hpp"
+#include "AreaCheck.hpp"
+#include "AreaIndex.hpp"
+#include "SpatiaLiteWriter.hpp"
+
+class Finding {
+	public:
+	std::string				layer;
+	Area					*a;
+	Area					*b;
+	std::string				message;
+	OGREnvelope				env;
+};
+
+/*
+ * Keeps the assembled areas and the R-tree after a run and answers
+ * line based queries on a unix socket. Findings reported to the writer
+ * are kept in memory and indexed so bbox queries never touch the database.
+ */
+class QueryServer {
+	AreaIndex&				index;
+	SpatiaLiteWriter&			writer;
+	std::vector<AreaProcess*>		processes;
+	std::vector<AreaCompare*>		compares;
+
+	/* Findings by id, the ids per area and an R-tree over their envelopes */
+	std::unordered_map<uint64_t, Finding>	findings;
+	std::unordered_map<Area*, std::vector<uint64_t>>	byarea;
+	si::ISpatialIndex			*frtree;
+	si::IStorageManager			*fsm;
+	si::id_type				frtree_id;
+	uint64_t				nextfinding=0;
+
+	/* While re-running checks only findings touching these are new */
+	std::unordered_set<Area*>		*filter=nullptr;
+	bool					running=true;
+
+	void record(const char *layer, Area *a, Area *b, const char *message);
+	void forget(const std::unordered_set<Area*>& areas);
+	void forget(uint64_t fid, Area *area);
+	void recheck(std::vector<Area*>& subset);
+	std::vector<Area*> lookup(const std::string& type, osmium::object_id_type id);
+	bool envelope(std::istream& in, OGREnvelope& env);
+	bool client(int fd, std::string& buffer);
+
+	void cmd_bbox(std::istream& in, std::ostream& out);
+	void cmd_object(std::istream& in, std::ostream& out);
+	void cmd_recheck(std::istream& in, std::ostream& out);
+	void cmd_update(std::istream& in, std::ostream& out);
+	void cmd_delete(std::istream& in, std::ostream& out);
+	public:
+	QueryServer(AreaIndex& index, SpatiaLiteWriter& writer);
+	~QueryServer();
+	void addcheck(AreaProcess *process);
+	void addcheck(AreaCompare *compare);
+	std::string handle(const std::string& line);
+	void serve(const std::string& path);
+};
+
+#endif
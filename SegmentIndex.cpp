@@ -0,0 +1,236 @@
+#include <algorithm>
+#include <cmath>
+#include <gdalcpp.hpp>
+
+#include "SegmentIndex.hpp"
+
+void SegmentIndex::collect(const OGRGeometry *geom, std::vector<Segment>& list) {
+	switch(geom->getGeometryType()) {
+		case(wkbLineString): {
+			const OGRLineString	*ring=static_cast<const OGRLineString*>(geom);
+			for(int i=0;i+1<ring->getNumPoints();i++)
+				list.push_back(Segment{ring->getX(i), ring->getY(i), ring->getX(i+1), ring->getY(i+1)});
+			break;
+		}
+		case(wkbPolygon): {
+			const OGRPolygon	*poly=static_cast<const OGRPolygon*>(geom);
+			collect(poly->getExteriorRing(), list);
+			for(int i=0;i<poly->getNumInteriorRings();i++)
+				collect(poly->getInteriorRing(i), list);
+			break;
+		}
+		case(wkbMultiPolygon): {
+			const OGRMultiPolygon	*mp=static_cast<const OGRMultiPolygon*>(geom);
+			for(int i=0;i<mp->getNumGeometries();i++)
+				collect(mp->getGeometryRef(i), list);
+			break;
+		}
+		default: {
+			break;
+		}
+	}
+}
+
+size_t SegmentIndex::numpoints(const OGRGeometry *geom) {
+	switch(geom->getGeometryType()) {
+		case(wkbLineString): {
+			return static_cast<const OGRLineString*>(geom)->getNumPoints();
+		}
+		case(wkbPolygon): {
+			const OGRPolygon	*poly=static_cast<const OGRPolygon*>(geom);
+			size_t			points=numpoints(poly->getExteriorRing());
+			for(int i=0;i<poly->getNumInteriorRings();i++)
+				points+=numpoints(poly->getInteriorRing(i));
+			return points;
+		}
+		case(wkbMultiPolygon): {
+			const OGRMultiPolygon	*mp=static_cast<const OGRMultiPolygon*>(geom);
+			size_t			points=0;
+			for(int i=0;i<mp->getNumGeometries();i++)
+				points+=numpoints(mp->getGeometryRef(i));
+			return points;
+		}
+		default: {
+			break;
+		}
+	}
+	return 0;
+}
+
+SegmentIndex::SegmentIndex(const OGRGeometry *geom) {
+	collect(geom, segments);
+
+	OGREnvelope	env;
+	geom->getEnvelope(&env);
+
+	bucket(env.MinY, env.MaxY);
+}
+
+/* Loose segments e.g. the unshared part of a boundary within a window */
+SegmentIndex::SegmentIndex(std::vector<Segment>&& list) : segments(std::move(list)) {
+	double	min=0, max=0;
+
+	for(size_t i=0;i<segments.size();i++) {
+		const Segment&	s=segments[i];
+		if (i == 0 || std::min(s.y1, s.y2) < min)
+			min=std::min(s.y1, s.y2);
+		if (i == 0 || std::max(s.y1, s.y2) > max)
+			max=std::max(s.y1, s.y2);
+	}
+
+	bucket(min, max);
+}
+
+void SegmentIndex::bucket(double ymin, double ymax) {
+	/* Roughly sqrt(n) bands of sqrt(n) segments each */
+	size_t	nbands=std::max<size_t>(1, sqrt(segments.size()));
+
+	miny=ymin;
+	bandheight=(ymax-ymin)/nbands;
+	if (bandheight <= 0)
+		bandheight=1;
+
+	bands.resize(nbands);
+
+	for(uint32_t i=0;i<segments.size();i++) {
+		const Segment&	s=segments[i];
+		size_t		first=band(std::min(s.y1, s.y2));
+		size_t		last=band(std::max(s.y1, s.y2));
+
+		for(size_t b=first;b<=last;b++)
+			bands[b].push_back(i);
+	}
+}
+
+size_t SegmentIndex::band(double y) const {
+	if (y <= miny)
+		return 0;
+
+	size_t	b=(y-miny)/bandheight;
+
+	return std::min(b, bands.size()-1);
+}
+
+size_t SegmentIndex::size(void ) const {
+	return segments.size();
+}
+
+const Segment& SegmentIndex::segment(uint32_t i) const {
+	return segments[i];
+}
+
+/* Even-odd crossing test - only the band of y needs to be looked at */
+bool SegmentIndex::contains(double x, double y) const {
+	bool	inside=false;
+
+	if (y < miny || y > miny+bandheight*bands.size())
+		return false;
+
+	for(auto i : bands[band(y)]) {
+		const Segment&	s=segments[i];
+
+		if ((s.y1 > y) == (s.y2 > y))
+			continue;
+
+		double	xcross=s.x1+(y-s.y1)*(s.x2-s.x1)/(s.y2-s.y1);
+		if (x < xcross)
+			inside=!inside;
+	}
+
+	return inside;
+}
+
+static double orientation(double px, double py, double qx, double qy, double rx, double ry) {
+	return (qx-px)*(ry-py)-(qy-py)*(rx-px);
+}
+
+static int segmentcrossing(const Segment& s, const Segment& o) {
+	if (std::max(s.x1, s.x2) < std::min(o.x1, o.x2)
+		|| std::min(s.x1, s.x2) > std::max(o.x1, o.x2)
+		|| std::max(s.y1, s.y2) < std::min(o.y1, o.y2)
+		|| std::min(s.y1, s.y2) > std::max(o.y1, o.y2))
+		return CROSS_NONE;
+
+	double	d1=orientation(o.x1, o.y1, o.x2, o.y2, s.x1, s.y1);
+	double	d2=orientation(o.x1, o.y1, o.x2, o.y2, s.x2, s.y2);
+	double	d3=orientation(s.x1, s.y1, s.x2, s.y2, o.x1, o.y1);
+	double	d4=orientation(s.x1, s.y1, s.x2, s.y2, o.x2, o.y2);
+
+	if (((d1 > 0 && d2 < 0) || (d1 < 0 && d2 > 0))
+		&& ((d3 > 0 && d4 < 0) || (d3 < 0 && d4 > 0)))
+		return CROSS_PROPER;
+
+	/* An endpoint on the other segment - bounding boxes already overlap */
+	if ((d1 == 0 || d2 == 0) && ((d3 >= 0 && d4 <= 0) || (d3 <= 0 && d4 >= 0)))
+		return CROSS_TOUCH;
+	if ((d3 == 0 || d4 == 0) && ((d1 >= 0 && d2 <= 0) || (d1 <= 0 && d2 >= 0)))
+		return CROSS_TOUCH;
+
+	return CROSS_NONE;
+}
+
+/* Worst crossing of a single segment with the indexed ones */
+int SegmentIndex::crossing(const Segment& o) const {
+	double	ominy=std::min(o.y1, o.y2);
+	double	omaxy=std::max(o.y1, o.y2);
+	int	result=CROSS_NONE;
+
+	if (omaxy < miny || ominy > miny+bandheight*bands.size())
+		return CROSS_NONE;
+
+	for(size_t b=band(ominy);b<=band(omaxy);b++) {
+		for(auto i : bands[b]) {
+			int	c=segmentcrossing(segments[i], o);
+
+			if (c == CROSS_PROPER)
+				return CROSS_PROPER;
+			if (c == CROSS_TOUCH)
+				result=CROSS_TOUCH;
+		}
+	}
+
+	return result;
+}
+
+/*
+ * Test all segments of geom against the index. Any proper crossing
+ * wins, touching segments leave the topology unclear.
+ */
+int SegmentIndex::crossing(const OGRGeometry *geom) const {
+	std::vector<Segment>	other;
+	int			result=CROSS_NONE;
+
+	collect(geom, other);
+
+	for(auto& o : other) {
+		int	c=crossing(o);
+
+		if (c == CROSS_PROPER)
+			return CROSS_PROPER;
+		if (c == CROSS_TOUCH)
+			result=CROSS_TOUCH;
+	}
+
+	return result;
+}
+
+/*
+ * Segments whose envelope widened by margin contains x/y. Segments
+ * spanning several bands may be returned more than once.
+ */
+void SegmentIndex::nearby(double x, double y, double margin, std::vector<uint32_t>& list) const {
+	if (y+margin < miny || y-margin > miny+bandheight*bands.size())
+		return;
+
+	for(size_t b=band(y-margin);b<=band(y+margin);b++) {
+		for(auto i : bands[b]) {
+			const Segment&	s=segments[i];
+
+			if (x < std::min(s.x1, s.x2)-margin || x > std::max(s.x1, s.x2)+margin
+				|| y < std::min(s.y1, s.y2)-margin || y > std::max(s.y1, s.y2)+margin)
+				continue;
+
+			list.push_back(i);
+		}
+	}
+}
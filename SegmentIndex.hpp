@@ -0,0 +1,48 @@
+#ifndef SEGMENTINDEX_HPP
+#define SEGMENTINDEX_HPP
+
+#include <vector>
+#include <gdalcpp.hpp>
+
+enum {
+	CROSS_NONE,
+	CROSS_TOUCH,
+	CROSS_PROPER
+};
+
+class Segment {
+	public:
+	double					x1;
+	double					y1;
+	double					x2;
+	double					y2;
+};
+
+/*
+ * Segments of all rings of a huge polygon bucketed into horizontal
+ * bands. A point or segment query only has to look at the bands
+ * covering its y range instead of walking all rings.
+ */
+class SegmentIndex {
+	std::vector<Segment>			segments;
+	std::vector<std::vector<uint32_t>>	bands;
+	double					miny;
+	double					bandheight;
+
+	size_t band(double y) const;
+	void bucket(double miny, double maxy);
+	public:
+	SegmentIndex(const OGRGeometry *geom);
+	SegmentIndex(std::vector<Segment>&& list);
+	size_t size(void ) const;
+	const Segment& segment(uint32_t i) const;
+	bool contains(double x, double y) const;
+	int crossing(const Segment& o) const;
+	int crossing(const OGRGeometry *geom) const;
+	void nearby(double x, double y, double margin, std::vector<uint32_t>& list) const;
+
+	static void collect(const OGRGeometry *geom, std::vector<Segment>& list);
+	static size_t numpoints(const OGRGeometry *geom);
+};
+
+#endif
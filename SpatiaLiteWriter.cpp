@@ -6,24 +6,29 @@
 
 #include "Area.hpp"
 #include "SpatiaLiteWriter.hpp"
+#include "Stats.hpp"
+#include "Profiler.hpp"
 #include <iostream>
+#include <sstream>
+#include <algorithm>
 
 #define DEBUG	0
 
+/* Spatial indexes are built in finalize after the bulk load */
 void SpatiaLiteWriter::addAreaOverlapLayer(const char *name) {
-	gdalcpp::Layer *layer=new gdalcpp::Layer(dataset, name, wkbMultiPolygon);
+	gdalcpp::Layer *layer=new gdalcpp::Layer(dataset, name, wkbMultiPolygon, {"SPATIAL_INDEX=NO"});
 
-	layer->add_field("area1_id", OFTString, 20);
+	layer->add_field("area1_id", OFTInteger64, 20);
 	layer->add_field("area1_type", OFTString, 20);
-	layer->add_field("area1_changeset", OFTString, 20);
+	layer->add_field("area1_changeset", OFTInteger64, 20);
 	layer->add_field("area1_user", OFTString, 20);
 	layer->add_field("area1_timestamp", OFTString, 20);
 	layer->add_field("area1_key", OFTString, 20);
 	layer->add_field("area1_value", OFTString, 20);
 
-	layer->add_field("area2_id", OFTString, 20);
+	layer->add_field("area2_id", OFTInteger64, 20);
 	layer->add_field("area2_type", OFTString, 20);
-	layer->add_field("area2_changeset", OFTString, 20);
+	layer->add_field("area2_changeset", OFTInteger64, 20);
 	layer->add_field("area2_user", OFTString, 20);
 	layer->add_field("area2_timestamp", OFTString, 20);
 	layer->add_field("area2_key", OFTString, 20);
@@ -32,14 +37,39 @@ void SpatiaLiteWriter::addAreaOverlapLayer(const char *name) {
 	layer->add_field("style", OFTString, 20);
 
 	layermap[name]=layer;
+	indexfields[name]={ "area1_id", "area2_id", "style" };
+	featurecounter[layer]=stats.counter(std::string("features.")+name);
+}
+
+/*
+ * The observer sees every finding, persist switches off writing to the
+ * database e.g. for checks re-run by the query server.
+ */
+void SpatiaLiteWriter::setObserver(std::function<void(const char *, Area *, Area *, const char *)> fn) {
+	observer=fn;
+}
+
+void SpatiaLiteWriter::setPersist(bool p) {
+	persist=p;
+}
+
+/* Overlaps below m² or below ratio of the smaller area are not written */
+void SpatiaLiteWriter::setMinOverlapArea(const std::string& layername, double area) {
+	thresholds[layername].area=area;
+	thresholds[layername].skipped=stats.counter("skipped."+layername);
+}
+
+void SpatiaLiteWriter::setMinOverlapRatio(const std::string& layername, double ratio) {
+	thresholds[layername].ratio=ratio;
+	thresholds[layername].skipped=stats.counter("skipped."+layername);
 }
 
 void SpatiaLiteWriter::addAreaLayer(const char *name) {
-	gdalcpp::Layer *layer=new gdalcpp::Layer(dataset, name, wkbMultiPolygon);
+	gdalcpp::Layer *layer=new gdalcpp::Layer(dataset, name, wkbMultiPolygon, {"SPATIAL_INDEX=NO"});
 
-	layer->add_field("area_id", OFTString, 20);
+	layer->add_field("area_id", OFTInteger64, 20);
 	layer->add_field("area_type", OFTString, 20);
-	layer->add_field("area_changeset", OFTString, 20);
+	layer->add_field("area_changeset", OFTInteger64, 20);
 	layer->add_field("area_user", OFTString, 20);
 	layer->add_field("area_timestamp", OFTString, 20);
 	layer->add_field("area_key", OFTString, 20);
@@ -50,30 +80,53 @@ void SpatiaLiteWriter::addAreaLayer(const char *name) {
 	layer->add_field("style", OFTString, 20);
 
 	layermap[name]=layer;
+	indexfields[name]={ "area_id", "style" };
+	featurecounter[layer]=stats.counter(std::string("features.")+name);
 }
 
-
-SpatiaLiteWriter::SpatiaLiteWriter(std::string &dbname) :
-		dataset("sqlite", dbname, gdalcpp::SRS{}, {"SPATIALITE=TRUE", "INIT_WITH_EPSG=no"}) {
+SpatiaLiteWriter::SpatiaLiteWriter(const std::string &dbname) :
+		dataset("sqlite", dbname, gdalcpp::SRS{}, {"SPATIALITE=TRUE", "INIT_WITH_EPSG=no"}),
+		writerphase(stats.phase("writer")) {
 
 	dataset.enable_auto_transactions();
 }
 
+/*
+ * Once everything is written build the spatial and attribute indexes
+ * in one go, update the planner statistics and compact the file so
+ * bbox queries of the viewer touch as few pages as possible.
+ */
+void SpatiaLiteWriter::finalize(void ) {
+	dataset.disable_auto_transactions();
+
+	for(auto& l : indexfields) {
+		const std::string&	name=l.first;
+
+		dataset.exec("SELECT CreateSpatialIndex('"+name+"', 'GEOMETRY')");
+
+		for(auto& field : l.second)
+			dataset.exec("CREATE INDEX IF NOT EXISTS "+name+"_"+field+"_idx ON "+name+"("+field+")");
+	}
+
+	dataset.exec("ANALYZE");
+	dataset.exec("VACUUM");
+}
+
 void SpatiaLiteWriter::writeMultiPolygontoLayer(gdalcpp::Layer *layer, Area *a, Area *b, std::unique_ptr<OGRGeometry> mpoly, const char *style) {
 	try  {
 		gdalcpp::Feature feature{*layer, std::move(mpoly)};
 
-		feature.set_field("area1_id", static_cast<double>(a->osm_id));
+		feature.set_field("area1_id", static_cast<GIntBig>(a->osm_id));
 		feature.set_field("area1_type", a->source_string());
-		feature.set_field("area1_changeset", static_cast<double>(a->osm_changeset));
+		feature.set_field("area1_changeset", static_cast<GIntBig>(a->osm_changeset));
 		feature.set_field("area1_timestamp", a->osm_timestamp.to_iso().c_str());
 		feature.set_field("area1_user", a->osm_user.c_str());
 		feature.set_field("area1_key", a->osm_key);
 		feature.set_field("area1_value", a->osm_value);
 
-		feature.set_field("area2_id", static_cast<double>(b->osm_id));
+		feature.set_field("area2_id", static_cast<GIntBig>(b->osm_id));
 		feature.set_field("area2_type", b->source_string());
-		feature.set_field("area2_changeset", static_cast<double>(b->osm_changeset));
+		feature.set_field("area2_changeset", static_cast<GIntBig>(b->osm_changeset));
 		feature.set_field("area2_timestamp", b->osm_timestamp.to_iso().c_str());
 		feature.set_field("area2_user", b->osm_user.c_str());
 		feature.set_field("area2_key", b->osm_key);
@@ -82,8 +135,11 @@ void SpatiaLiteWriter::writeMultiPolygontoLayer(gdalcpp::Layer *layer, Area *a,
 		feature.set_field("style", style);
 
 		feature.add_to_layer();
+		stats.count(featurecounter[layer]);
 
-		std::cout
+		/* One write per line so batch workers do not interleave */
+		std::ostringstream	line;
+		line
 				<< a->osm_key << " " << a->osm_value << " "
 				<< a->source_string() << " " << a->osm_id << " overlaps "
 				<< b->osm_key << " " << b->osm_value << " "
@@ -93,6 +149,7 @@ void SpatiaLiteWriter::writeMultiPolygontoLayer(gdalcpp::Layer *layer, Area *a,
 				<< a->osm_timestamp.to_iso() << "," << b->osm_timestamp.to_iso() << " "
 				<< a->osm_user << "," << b->osm_user
 				<< std::endl;
+		std::cout << line.str();
 
 	} catch (gdalcpp::gdal_error) {
 		std::cerr << "gdal_error while creating feature " << std::endl;
@@ -126,15 +183,100 @@ void SpatiaLiteWriter::writeGeometry(gdalcpp::Layer *layer, Area *a, Area *b, OG
 	}
 }
 
+/*
+ * For giant areas cut the rings down to the common envelope before
+ * handing them to GEOS. The window is widened a bit so degenerate
+ * edges from clipping never touch the other area.
+ */
+OGRGeometry *clippedintersection(Area *a, Area *b) {
+	OGREnvelope	window, benv;
+	double		margin=0.0001;
+
+	a->envelope(window);
+	b->envelope(benv);
+	window.Intersect(benv);
+
+	window.MinX-=margin; window.MaxX+=margin;
+	window.MinY-=margin; window.MaxY+=margin;
+
+	std::unique_ptr<OGRGeometry>	ca{a->segindex ? a->clipped(window) : nullptr};
+	std::unique_ptr<OGRGeometry>	cb{b->segindex ? b->clipped(window) : nullptr};
+
+	const OGRGeometry	*ga=ca ? ca.get() : a->geometry;
+	const OGRGeometry	*gb=cb ? cb.get() : b->geometry;
+
+	return ga->Intersection(gb);
+}
+
 void SpatiaLiteWriter::write_overlap(Area *a, Area *b, const char *layername) {
+	StatsTimer		timer{writerphase};
+	ProfileScope		profile{"write_overlap", a, b};
+
 	if (!a || !b || a->geometry == nullptr || b->geometry == nullptr)
 		return;
 
-	std::unique_ptr<OGRGeometry> intersection{a->geometry->Intersection(b->geometry)};
+	const OverlapThreshold	*threshold=nullptr;
+	double			smaller=0;
+
+	auto t=thresholds.find(layername);
+	if (t != thresholds.end())
+		threshold=&t->second;
+
+	/*
+	 * The common envelope is an upper bound of the overlap - if that
+	 * already fails the thresholds skip the intersection.
+	 */
+	if (threshold) {
+		OGREnvelope	window, benv;
+
+		a->envelope(window);
+		b->envelope(benv);
+		window.Intersect(benv);
+
+		double	bound=squaremeters(window);
+		smaller=std::min(a->squaremeters(), b->squaremeters());
+
+		if (bound < threshold->area
+			|| (smaller > 0 && bound/smaller < threshold->ratio)) {
+			stats.count(threshold->skipped);
+			return;
+		}
+	}
+
+	/* Without thresholds the geometry is only needed for the database */
+	if (!persist && !threshold) {
+		if (observer)
+			observer(layername, a, b, layername);
+		return;
+	}
+
+	std::unique_ptr<OGRGeometry> intersection;
+
+	if (a->segindex || b->segindex)
+		intersection.reset(clippedintersection(a, b));
+
+	/* Clipping may upset GEOS - fall back to the full geometry */
+	if (!intersection)
+		intersection.reset(a->geometry->Intersection(b->geometry));
 
 	if (!intersection)
 		return;
 
+	if (threshold) {
+		double	overlap=squaremeters(intersection.get());
+
+		if (overlap < threshold->area
+			|| (smaller > 0 && overlap/smaller < threshold->ratio)) {
+			stats.count(threshold->skipped);
+			return;
+		}
+	}
+
+	if (observer)
+		observer(layername, a, b, layername);
+	if (!persist)
+		return;
+
 	if (DEBUG) {
 		std::cout << "Intersecion WKT" << std::endl;
 		intersection->dumpReadable(stdout, nullptr, nullptr);
@@ -150,15 +292,52 @@ void SpatiaLiteWriter::write_overlap(Area *a, Area *b, const char *layername) {
 	writeGeometry(layer, a, b, intersection.get(), layername);
 }
 
+/* Mark a gap between glued neighbours by a small square around the vertex */
+void SpatiaLiteWriter::write_gap(Area *a, Area *b, double x, double y, const char *layername) {
+	StatsTimer		timer{writerphase};
+
+	if (observer)
+		observer(layername, a, b, layername);
+	if (!persist)
+		return;
+
+	gdalcpp::Layer		*layer=layermap[layername];
+
+	if (!layer) {
+		std::cerr << "Undefined references layer " << layername << std::endl;
+		abort();
+	}
+
+	double		size=0.00001;
+	OGRLinearRing	ring;
+	ring.addPoint(x-size, y-size);
+	ring.addPoint(x+size, y-size);
+	ring.addPoint(x+size, y+size);
+	ring.addPoint(x-size, y+size);
+	ring.closeRings();
+
+	OGRPolygon	poly;
+	poly.addRing(&ring);
+
+	writeGeometry(layer, a, b, &poly, layername);
+}
+
 void SpatiaLiteWriter::writeAreaLayer(const char *layername, Area *a, const char *style, const char *errormsg) {
+	StatsTimer		timer{writerphase};
+
+	if (observer)
+		observer(layername, a, nullptr, errormsg);
+	if (!persist)
+		return;
+
 	gdalcpp::Layer		*layer=layermap[layername];
 	try  {
 		std::unique_ptr<OGRGeometry>	geom{a->geometry->clone()};
 		gdalcpp::Feature feature{*layer, std::move(geom)};
 
-		feature.set_field("area_id", static_cast<double>(a->osm_id));
+		feature.set_field("area_id", static_cast<GIntBig>(a->osm_id));
 		feature.set_field("area_type", a->source_string());
-		feature.set_field("area_changeset", static_cast<double>(a->osm_changeset));
+		feature.set_field("area_changeset", static_cast<GIntBig>(a->osm_changeset));
 		feature.set_field("area_timestamp", a->osm_timestamp.to_iso().c_str());
 		feature.set_field("area_user", a->osm_user.c_str());
 		feature.set_field("area_key", a->osm_key);
@@ -168,12 +347,15 @@ void SpatiaLiteWriter::writeAreaLayer(const char *layername, Area *a, const char
 		feature.set_field("style", style);
 
 		feature.add_to_layer();
+		stats.count(featurecounter[layer]);
 
-		std::cout
+		std::ostringstream	line;
+		line
 				<< a->osm_key << " " << a->osm_value << " "
 				<< a->source_string() << " " << a->osm_id
 				<< " error " << errormsg
 				<< std::endl;
+		std::cout << line.str();
 
 	} catch (gdalcpp::gdal_error) {
 		std::cerr << "gdal_error while creating feature " << std::endl;
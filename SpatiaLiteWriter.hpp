@@ -1,25 +1,49 @@
 #ifndef SPATIALITEWRITER_HPP
 #define SPATIALITEWRITER_HPP
 
+#include <functional>
+#include <unordered_map>
 #include <osmium/handler.hpp>
 #include <gdalcpp.hpp>
 #include <osmium/geom/ogr.hpp>
 
 #include "Area.hpp"
 
+class OverlapThreshold {
+	public:
+	double					area=0;
+	double					ratio=0;
+	size_t					skipped=0;
+};
+
 class SpatiaLiteWriter : public osmium::handler::Handler {
 	gdalcpp::Dataset		dataset;
 	osmium::geom::OGRFactory<>	m_factory{};
 
 	std::map<std::string, gdalcpp::Layer*>	layermap;
+	std::map<std::string, OverlapThreshold>	thresholds;
+	std::map<std::string, std::vector<std::string>>	indexfields;
+
+	std::function<void(const char *, Area *, Area *, const char *)>	observer;
+	bool					persist=true;
+
+	/* Stats slots */
+	size_t					writerphase;
+	std::unordered_map<gdalcpp::Layer*, size_t>	featurecounter;
 
 	public:
-	SpatiaLiteWriter(std::string &dbname);
+	SpatiaLiteWriter(const std::string &dbname);
+	void finalize(void );
+	void setObserver(std::function<void(const char *, Area *, Area *, const char *)> fn);
+	void setPersist(bool p);
 
 	void addAreaLayer(const char *name);
 	void addAreaOverlapLayer(const char *name);
+	void setMinOverlapArea(const std::string& layername, double area);
+	void setMinOverlapRatio(const std::string& layername, double ratio);
 
 	void write_overlap(Area *a, Area *b, const char *layername);
+	void write_gap(Area *a, Area *b, double x, double y, const char *layername);
 	void writeAreaLayer(const char *layername, Area *a, const char *style, const char *errormsg);
 
 	private:
@@ -28,4 +52,6 @@ class SpatiaLiteWriter : public osmium::handler::Handler {
 
 };
 
+OGRGeometry *clippedintersection(Area *a, Area *b);
+
 #endif
@@ -0,0 +1,182 @@
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <sys/resource.h>
+
+#include "Stats.hpp"
+
+thread_local Stats	stats;
+
+Stats::Stats() {
+	epoch=std::chrono::steady_clock::now();
+	lastprogress=epoch;
+	progressstart=epoch;
+}
+
+void Stats::enable(void ) {
+	enabled=true;
+}
+
+/*
+ * Account cpu time to the calling thread only and prefix progress
+ * with the job name. Reader threads of osmium are not accounted then.
+ */
+void Stats::batchjob(const std::string& name) {
+	job=name;
+}
+
+double Stats::wall(void ) const {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now()-epoch).count();
+}
+
+double Stats::cpu(void ) const {
+	struct rusage	ru;
+
+	getrusage(job.empty() ? RUSAGE_SELF : RUSAGE_THREAD, &ru);
+
+	return ru.ru_utime.tv_sec+ru.ru_utime.tv_usec/1e6
+		+ru.ru_stime.tv_sec+ru.ru_stime.tv_usec/1e6;
+}
+
+size_t Stats::phase(const char *name) {
+	for(size_t i=0;i<phases.size();i++)
+		if (phases[i].name == name)
+			return i;
+
+	phases.push_back(Phase());
+	phases.back().name=name;
+
+	return phases.size()-1;
+}
+
+/* Phases may be started again - times accumulate */
+void Stats::start(size_t slot) {
+	if (!enabled)
+		return;
+
+	Phase&	p=phases[slot];
+
+	p.wallstart=wall();
+	p.cpustart=cpu();
+}
+
+void Stats::stop(size_t slot) {
+	if (!enabled)
+		return;
+
+	Phase&	p=phases[slot];
+
+	p.wall+=wall()-p.wallstart;
+	p.cpu+=cpu()-p.cpustart;
+}
+
+void Stats::start(const char *name) {
+	if (enabled)
+		start(phase(name));
+}
+
+void Stats::stop(const char *name) {
+	if (enabled)
+		stop(phase(name));
+}
+
+size_t Stats::counter(const std::string& name) {
+	auto	it=counterslots.find(name);
+	if (it != counterslots.end())
+		return it->second;
+
+	counters.push_back(std::make_pair(name, 0));
+	counterslots[name]=counters.size()-1;
+
+	return counters.size()-1;
+}
+
+/* By name - for places not hot enough to keep a slot */
+void Stats::count(const std::string& name, uint64_t n) {
+	if (enabled)
+		count(counter(name), n);
+}
+
+/* Peak resident set size in KB */
+long Stats::peakrss(void ) const {
+	struct rusage	ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return ru.ru_maxrss;
+}
+
+/* Print rate and ETA every 5 seconds - cheap enough to call per area */
+void Stats::progress(const char *what, size_t done, size_t total) {
+	if (done & 1023)
+		return;
+
+	auto	now=std::chrono::steady_clock::now();
+
+	if (progresswhat != what) {
+		progresswhat=what;
+		progressstart=now;
+		lastprogress=now;
+		return;
+	}
+
+	if (now-lastprogress < std::chrono::seconds(5))
+		return;
+
+	lastprogress=now;
+
+	double	elapsed=std::chrono::duration<double>(now-progressstart).count();
+	double	rate=done/elapsed;
+	double	eta=(total > done) ? (total-done)/rate : 0;
+
+	std::ostringstream	line;
+	if (!job.empty())
+		line << job << " ";
+	line << what << ": " << done << "/" << total << " areas "
+		<< std::fixed << std::setprecision(0) << rate << " areas/s "
+		<< "ETA " << eta << "s" << std::endl;
+
+	std::cerr << line.str();
+}
+
+bool Stats::write(const std::string& filename) {
+	std::ofstream	out(filename);
+
+	if (!out) {
+		std::cerr << "Unable to write stats to " << filename << std::endl;
+		return false;
+	}
+
+	out << std::fixed << std::setprecision(3);
+	out << "{" << std::endl;
+
+	out << "\t\"phases\": {" << std::endl;
+	for(size_t i=0;i<phases.size();i++) {
+		const Phase&	p=phases[i];
+		out << "\t\t\"" << p.name << "\": { \"wall\": " << p.wall
+			<< ", \"cpu\": " << p.cpu << " }"
+			<< ((i+1 < phases.size()) ? "," : "") << std::endl;
+	}
+	out << "\t}," << std::endl;
+
+	std::vector<std::pair<std::string, uint64_t>>	sorted(counters);
+	std::sort(sorted.begin(), sorted.end());
+
+	out << "\t\"counters\": {" << std::endl;
+	size_t	i=0;
+	for(auto& c : sorted) {
+		out << "\t\t\"" << c.first << "\": " << c.second
+			<< ((++i < sorted.size()) ? "," : "") << std::endl;
+	}
+	out << "\t}," << std::endl;
+
+	out << "\t\"wall\": " << wall() << "," << std::endl;
+	out << "\t\"cpu\": " << cpu() << "," << std::endl;
+	/* Batch jobs share the process - its peak is not the one of the job */
+	out << "\t\"" << (job.empty() ? "peak_rss_kb" : "process_peak_rss_kb") << "\": " << peakrss() << std::endl;
+	out << "}" << std::endl;
+
+	return true;
+}
@@ -0,0 +1,80 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*
+ * Run statistics - wall and cpu time per phase, plain counters and
+ * progress on stderr. Written as JSON at the end of the run. Hot paths
+ * resolve counters and phases to slots once, nothing is counted or
+ * timed unless enabled.
+ */
+class Stats {
+	class Phase {
+		public:
+		std::string				name;
+		double					wall=0;
+		double					cpu=0;
+		double					wallstart=0;
+		double					cpustart=0;
+	};
+
+	bool					enabled=false;
+	std::vector<Phase>			phases;
+	std::vector<std::pair<std::string, uint64_t>>	counters;
+	std::unordered_map<std::string, size_t>	counterslots;
+
+	std::chrono::steady_clock::time_point	epoch;
+	std::chrono::steady_clock::time_point	lastprogress;
+	std::chrono::steady_clock::time_point	progressstart;
+	std::string				progresswhat;
+
+	/* Set for batch jobs which share the process with other jobs */
+	std::string				job;
+
+	double wall(void ) const;
+	double cpu(void ) const;
+	public:
+	Stats();
+	void enable(void );
+	bool on(void ) const { return enabled; }
+	void batchjob(const std::string& name);
+	size_t phase(const char *name);
+	void start(size_t slot);
+	void stop(size_t slot);
+	void start(const char *name);
+	void stop(const char *name);
+	size_t counter(const std::string& name);
+	void count(size_t slot, uint64_t n=1) {
+		if (enabled)
+			counters[slot].second+=n;
+	}
+	void count(const std::string& name, uint64_t n=1);
+	void progress(const char *what, size_t done, size_t total);
+	long peakrss(void ) const;
+	bool write(const std::string& filename);
+};
+
+/* One per thread so batch jobs account separately */
+extern thread_local Stats	stats;
+
+/* Times the enclosing scope as the given phase slot */
+class StatsTimer {
+	size_t		slot;
+	bool		active;
+	public:
+	StatsTimer(size_t slot) : slot(slot), active(stats.on()) {
+		if (active)
+			stats.start(slot);
+	}
+	~StatsTimer() {
+		if (active)
+			stats.stop(slot);
+	}
+};
+
+#endif
@@ -2,26 +2,16 @@
 #include <cstdlib>  // for std::exit
 #include <cstring>  // for std::strcmp
 #include <iostream> // for std::cout, std::cerr
-
-// For assembling multipolygons
-#include <osmium/area/assembler.hpp>
-#include <osmium/area/multipolygon_manager.hpp>
-
-// For the DynamicHandler class
-#include <osmium/dynamic_handler.hpp>
-
-// For the Dump handler
-#include <osmium/handler/dump.hpp>
-
-// For the NodeLocationForWays handler
-#include <osmium/handler/node_locations_for_ways.hpp>
-
-// Allow any format of input files (XML, PBF, ...)
-#include <osmium/io/any_input.hpp>
-
-// For the location index. There are different types of indexes available.
-// This will work for all input files keeping the index in memory.
-#include <osmium/index/map/flex_mem.hpp>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <sys/stat.h>
 
 #include <boost/program_options.hpp>
 #include <boost/format.hpp>
@@ -30,301 +20,319 @@
 #include "Area.hpp"
 #include "AreaIndex.hpp"
 #include "AreaCheck.hpp"
+#include "Stats.hpp"
+#include "Profiler.hpp"
+#include "LanduseChecks.hpp"
+#include "QueryServer.hpp"
 
-// The type of index used. This must match the include file above
-using index_type = osmium::index::map::FlexMem<osmium::unsigned_object_id_type, osmium::Location>;
-
-// The location handler always depends on the index type
-using location_handler_type = osmium::handler::NodeLocationsForWays<index_type>;
+namespace po = boost::program_options;
 
-#define DEBUG 0
+typedef std::vector<std::pair<std::string, double>>	LayerValues;
 
-class AreaOverlapCompare : public AreaCompare {
+/* Per layer thresholds - parsed once in main, shared by all runs */
+class Thresholds {
 	public:
-		AreaOverlapCompare(SpatiaLiteWriter& writer) : AreaCompare(writer) {
-			writer.addAreaOverlapLayer("overlap");
-			writer.addAreaOverlapLayer("natural");
-		};
-
-		virtual bool WantA(Area *a) const {
-			if (a->osm_type == AREA_LANDUSE
-				|| a->osm_type == AREA_NATURAL)
-				return true;
-			return false;
-		}
+	LayerValues		area;
+	LayerValues		ratio;
+};
 
-		virtual bool WantB(Area *a) const {
-			return WantA(a);
-		}
+/* Split layer=value - exits on malformed arguments like option parsing does */
+static std::pair<std::string, double> layervalue(const std::string& arg) {
+	size_t	pos=arg.find('=');
 
-		virtual void Overlaps(Area *a, Area *b) const {
-			/*
-			 * Overlapping ourselves or an id smaller than ours
-			 * We only want to check a -> b not b -> a again as they
-			 * will overlap too anyway.
-			 */
-			if ((a->id >= b->id))
-				return;
-
-			if (a->osm_type != AREA_LANDUSE
-				&& a->osm_type != AREA_NATURAL)
-				return;
-
-			if (b->osm_type != AREA_LANDUSE
-				&& b->osm_type != AREA_NATURAL)
-				return;
-
-			if (a->overlaps(b)) {
-				if (a->osm_type == AREA_NATURAL || b->osm_type == AREA_NATURAL)
-					writer.write_overlap(a, b, "natural");
-				else
-					writer.write_overlap(a, b, "overlap");
-				return;
-			}
+	try {
+		if (pos != std::string::npos)
+			return std::make_pair(arg.substr(0, pos), std::stod(arg.substr(pos+1)));
+	} catch(const std::exception&) {
+	}
+
+	std::cerr << "Error: expected layer=value but got " << arg << std::endl;
+	exit(-1);
+}
+
+static LayerValues layervalues(const po::variables_map& vm, const char *option) {
+	LayerValues	list;
+
+	if (vm.count(option))
+		for(auto& arg : vm[option].as<std::vector<std::string>>())
+			list.push_back(layervalue(arg));
 
-			return;
+	return list;
+}
+
+/* One complete run from the input file to the finalized database */
+static void run(const po::variables_map& vm, const Thresholds& thresholds,
+		const std::string& infile, const std::string& dbname, const std::string& statsfile) {
+
+	if (vm.count("profile"))
+		profiler.enable(vm["profile-sample"].as<uint32_t>());
+
+	if (!statsfile.empty())
+		stats.enable();
+
+	AreaIndex	areahandler;
+	areahandler.setgiant(vm["giant"].as<size_t>());
+	areahandler.setadjacency(!vm["no-adjacency"].as<bool>());
+
+	areahandler.load(infile);
+
+	/* Only the query server adds areas after loading */
+	if (!vm.count("listen"))
+		areahandler.dropnodeindex();
+
+	if (vm["hilbert"].as<bool>()) {
+		stats.start("hilbert");
+		areahandler.hilbertsort();
+		stats.stop("hilbert");
+	}
+
+	{
+		SpatiaLiteWriter	writer{dbname};
+		std::unique_ptr<QueryServer>	server;
+
+		if (vm.count("listen"))
+			server.reset(new QueryServer(areahandler, writer));
+
+		for(auto& lv : thresholds.area)
+			writer.setMinOverlapArea(lv.first, lv.second);
+
+		for(auto& lv : thresholds.ratio)
+			writer.setMinOverlapRatio(lv.first, lv.second);
+
+		/* Writer time is accounted to the checks as well */
+		stats.start("size");
+		LanduseSize		ls{writer};
+		areahandler.foreach(ls);
+		if (server)
+			server->addcheck(&ls);
+		stats.stop("size");
+
+		stats.start("hierarchy");
+		AmenityIntersect	ai{writer};
+		areahandler.processoverlap(ai);
+		if (server)
+			server->addcheck(&ai);
+		stats.stop("hierarchy");
+
+		stats.start("overlap");
+		AreaOverlapCompare	luo{writer};
+		areahandler.processoverlap(luo);
+		if (server)
+			server->addcheck(&luo);
+		stats.stop("overlap");
+
+		/* Without adjacency there are no neighbours to look at */
+		std::unique_ptr<GluedGap>	gg;
+		if (areahandler.adjacencyenabled()) {
+			stats.start("gap");
+			gg.reset(new GluedGap{writer});
+			areahandler.foreach(*gg);
+			if (server)
+				server->addcheck(gg.get());
+			stats.stop("gap");
 		}
-};
 
-class AmenityIntersect : public AreaCompare {
-	public:
-		AmenityIntersect(SpatiaLiteWriter& writer) : AreaCompare(writer) {
-			writer.addAreaOverlapLayer("hierarchy");
-		};
-
-		virtual bool WantA(Area *a) const {
-			if (a->osm_type == AREA_NATURAL) {
-				if (strcasecmp(a->osm_value, "mountain_range") == 0)
-					return false;
-				return true;
-			}
-			if (a->osm_type == AREA_LANDUSE)
-				return true;
-			if (a->osm_type == AREA_AMENITY)
-				return true;
-			if (a->osm_type == AREA_MANMADE) {
-
-				/* Overlapping types - by default */
-				if (strcasecmp(a->osm_value, "pier") == 0)
-					return false;
-				if (strcasecmp(a->osm_value, "bridge") == 0)
-					return false;
-
-				return true;
-			}
-			if (a->osm_type == AREA_LEISURE) {
-				if (strcasecmp(a->osm_value, "nature_reserve") == 0)
-					return false;
-				return true;
-			}
-			if (a->osm_type == AREA_BUILDING) {
-				return true;
-			}
-			return false;
+		stats.start("finalize");
+		writer.finalize();
+		stats.stop("finalize");
+
+		/* Report the run before the server starts changing areas */
+		if (!statsfile.empty())
+			stats.write(statsfile);
+
+		if (vm.count("profile")) {
+			std::ostringstream	report;
+			profiler.report(report, vm["profile"].as<size_t>());
+			std::cerr << report.str();
 		}
 
-		bool WantB(Area *a) const {
-			return WantA(a);
+		/* Further findings only live in the server */
+		if (server) {
+			writer.setPersist(false);
+			server->serve(vm["listen"].as<std::string>());
 		}
+	}
 
-		void Overlaps(Area *a, Area *b) const {
-			/*
-			 * Overlapping ourselves or an id smaller than ours
-			 * We only want to check a -> b not b -> a again as they
-			 * will overlap too anyway.
-			 */
-			if ((a->id >= b->id) &&
-				(a->osm_type == b->osm_type))
-				return;
-
-			if (DEBUG)
-				std::cout << "Overlaps " << std::endl
-					<< "A Id: " << a->osm_id
-					<< "A Type: " << a->osm_key
-					<< "B Id: " << b->osm_id
-					<< "B Type: " << b->osm_key
-					<< std::endl;
-
-			/* One of them needs to be an AMENITY */
-			if (!((WantA(a) && WantB(b))
-				|| (WantA(b) && WantB(a))))
-				return;
-
-			if (DEBUG)
-				std::cout << "Checking for intersection" << std::endl;
-
-			if (a->intersects(b)) {
-
-				/* if a builing overlaps something - check layers */
-				if (a->osm_type == AREA_BUILDING
-					|| b->osm_type == AREA_BUILDING) {
-
-					if (a->osm_layer != b->osm_layer) {
-						return;
-					}
-				}
-
-				writer.write_overlap(a, b, "hierarchy");
-				return;
-			}
+	for(auto a : areahandler.arealist)
+		delete(a);
+}
 
-			return;
-		}
+class BatchJob {
+	public:
+	std::string		infile;
+	std::string		dbname;
+	std::string		statsfile;
+	off_t			size=0;
 };
 
-class LanduseSize : public AreaProcess {
-	OGRSpatialReference	tSRS;
+/* "infile dbname [statsfile]" per line, # starts a comment */
+static std::vector<BatchJob> readmanifest(const std::string& filename) {
+	std::ifstream		in{filename};
+	std::vector<BatchJob>	jobs;
+	std::string		line;
 
-	public:
-		LanduseSize(SpatiaLiteWriter& writer) : AreaProcess(writer) {
-			tSRS.importFromEPSG(31467);
+	if (!in) {
+		std::cerr << "Error: unable to open manifest " << filename << std::endl;
+		exit(-1);
+	}
 
-			writer.addAreaLayer("huge");
-			writer.addAreaLayer("suspicious");
-			writer.addAreaLayer("complex");
-		}
+	while(std::getline(in, line)) {
+		line=line.substr(0, line.find('#'));
 
-		bool WantA(Area *a) const {
-			if (a->osm_type == AREA_LANDUSE)
-				return true;
-			return false;
-		}
+		std::istringstream	fields{line};
+		BatchJob		job;
 
-		bool WantB(Area *a) const {
-			return WantA(a);
-		}
+		if (!(fields >> job.infile))
+			continue;
 
-		float polygon_area(OGRGeometry *geom) const {
-			switch(geom->getGeometryType()) {
-				case(wkbPolygon): {
-					return static_cast<const OGRPolygon*>(geom)->get_Area();
-				}
-				case(wkbMultiPolygon): {
-					return static_cast<const OGRMultiPolygon*>(geom)->get_Area();
-				}
-				default: {
-					break;
-				};
-			}
-			return 0;
+		if (!(fields >> job.dbname)) {
+			std::cerr << "Error: no output database for " << job.infile << " in " << filename << std::endl;
+			exit(-1);
 		}
 
-		double distance(const OGRPoint& a, const OGRPoint& b) const {
-			return a.Distance((OGRGeometry *)&b);
-		}
+		fields >> job.statsfile;
 
-		double polygon_complexity(const OGRGeometry *geom) const {
-			double			complexity=0;
-
-			switch(geom->getGeometryType()) {
-				case(wkbLineString): {
-					const OGRLineString	*ring=static_cast<const OGRLineString*>(geom);
-					int numpoints=ring->getNumPoints();
-
-					// Summe der innenwinkel im dreieck
-					if (numpoints <= 3)
-						return 180;
-					// Summe der innenwinkel im rechteck
-					if (numpoints == 4)
-						return 360;
-
-					if (DEBUG)
-						std::cout << "Looping on points" << std::endl;
-
-					for(int i=0;i<numpoints;i++) {
-						OGRPoint	Pa,Pb,Pc;
-
-						ring->getPoint(i%(numpoints-1), &Pa);
-						ring->getPoint((i+1)%(numpoints-1), &Pb);
-						ring->getPoint((i+2)%(numpoints-1), &Pc);
-
-						double a=distance(Pa, Pb);
-						double b=distance(Pb, Pc);
-						double c=distance(Pc, Pa);
-
-						double rad=acos((a*a+b*b-c*c)/(2*a*b));
-						double angle=rad*(180/3.1415926);
-
-						if (DEBUG) {
-							std::cout
-								<< " Pa.X " << Pa.getX()
-								<< " Pa.Y " << Pa.getY()
-								<< " a " << a
-								<< " b " << c
-								<< " c " << a
-								<< " rad " << rad
-								<< " angle " << angle
-								<< std::endl;
-						}
-
-						complexity+=(180-angle);
-					}
-					break;
-				}
-				case(wkbPolygon): {
-					const OGRLinearRing	*lr=static_cast<const OGRPolygon*>(geom)->getExteriorRing();
-					complexity+=polygon_complexity(lr);
-					break;
-				}
-				case(wkbMultiPolygon): {
-					const OGRMultiPolygon *mp=static_cast<const OGRMultiPolygon*>(geom);
-					int numgeom=mp->getNumGeometries();
-
-					for(int i=0;i<numgeom;i++) {
-						const OGRGeometry *subgeom=mp->getGeometryRef(i);
-						complexity+=polygon_complexity(subgeom);
-					}
-					break;
-				}
-				default: {
-					std::cout << "Unknown geometry type " << geom->getGeometryName()
-						<< "(" << geom->getGeometryType() << ")" << std::endl;
-				};
+		struct stat	st;
+		if (stat(job.infile.c_str(), &st) == 0)
+			job.size=st.st_size;
+
+		jobs.push_back(job);
+	}
+
+	return jobs;
+}
+
+/*
+ * Shared job queue, largest input first. Memory use grows with the
+ * input, so at most maxlarge inputs above largesize run at once. While
+ * that limit is reached workers take the next smaller job instead.
+ */
+class BatchQueue {
+	std::vector<BatchJob>&		jobs;
+	std::vector<bool>		taken;
+	std::mutex			lock;
+	std::condition_variable		done;
+	off_t				largesize;
+	unsigned int			maxlarge;
+	unsigned int			large=0;
+
+	bool islarge(const BatchJob& job) const {
+		return job.size >= largesize;
+	}
+	public:
+	BatchQueue(std::vector<BatchJob>& jobs, off_t largesize, unsigned int maxlarge) :
+			jobs(jobs), taken(jobs.size(), false),
+			largesize(largesize), maxlarge(std::max(1u, maxlarge)) {
+
+		std::stable_sort(jobs.begin(), jobs.end(), [](const BatchJob& a, const BatchJob& b) {
+			return a.size > b.size;
+		});
+	}
+
+	/* Next job to run or nullptr when all are taken */
+	BatchJob *next(void ) {
+		std::unique_lock<std::mutex>	l{lock};
+
+		for(;;) {
+			bool	left=false;
+
+			for(size_t i=0;i<jobs.size();i++) {
+				if (taken[i])
+					continue;
+				left=true;
+
+				if (islarge(jobs[i]) && large >= maxlarge)
+					continue;
+
+				taken[i]=true;
+				if (islarge(jobs[i]))
+					large++;
+				return &jobs[i];
 			}
 
-			return complexity;
+			if (!left)
+				return nullptr;
+
+			/* Only large jobs left - wait for a running one */
+			done.wait(l);
 		}
+	}
 
-		void Process(Area *a) const {
-			OGRGeometry	*geom=a->geometry->clone();
-			geom->transformTo((OGRSpatialReference *) &tSRS);
+	void finish(BatchJob *job) {
+		std::lock_guard<std::mutex>	l{lock};
 
-			double complexity=polygon_complexity(geom);
-			if (complexity > 2000) {
-				std::string s=boost::str(boost::format("Complexity %1$.1f") % complexity);
-				writer.writeAreaLayer("complex", a, "complex", s.c_str());
-			}
+		if (islarge(*job))
+			large--;
+		done.notify_all();
+	}
+};
 
-			float areasize=polygon_area(geom);
-
-			if (areasize < 40) {
-				std::string s=boost::str(boost::format("Small landuse  %1$.2fm² below 40m²") % areasize);
-				writer.writeAreaLayer("suspicious", a, "lsize1", s.c_str());
-			} else if (areasize < 100) {
-				std::string s=boost::str(boost::format("Small landuse  %1$.2fm² below 100m²") % areasize);
-				writer.writeAreaLayer("suspicious", a, "lsize2", s.c_str());
-			} else if (areasize > 400000) {
-				std::string s=boost::str(boost::format("Huge landuse %1$.0fm² > 400000m²") % areasize);
-				writer.writeAreaLayer("huge", a, "huge2", s.c_str());
-			} else if (areasize > 200000) {
-				std::string s=boost::str(boost::format("Large landuse %1$.0fm² > 200000m²") % areasize);
-				writer.writeAreaLayer("huge", a, "huge1", s.c_str());
+/*
+ * Run all jobs on a fixed set of workers taking jobs from the shared
+ * queue, so the small regions fill up the workers which finish early.
+ * GDAL, PROJ and the osmium reader pool stay initialized across jobs.
+ */
+static int batch(const po::variables_map& vm, const Thresholds& thresholds,
+		std::vector<BatchJob>& jobs, unsigned int workers) {
+	BatchQueue			queue{jobs, (off_t) vm["large-size"].as<size_t>()*1024*1024,
+						vm["max-parallel-large"].as<unsigned int>()};
+	std::atomic<size_t>		failed{0};
+	std::vector<std::thread>	threads;
+	auto				start=std::chrono::steady_clock::now();
+
+	auto worker=[&]() {
+		for(BatchJob *jp=queue.next();jp;jp=queue.next()) {
+			BatchJob&	job=*jp;
+
+			stats=Stats();
+			stats.batchjob(job.infile);
+			profiler=Profiler();
+
+			try {
+				run(vm, thresholds, job.infile, job.dbname, job.statsfile);
+				std::cerr << (job.infile + " done\n");
+			} catch(const std::exception& e) {
+				failed++;
+				std::cerr << (job.infile + " failed: " + e.what() + "\n");
 			}
 
-			delete(geom);
+			queue.finish(jp);
 		}
-};
+	};
 
+	for(unsigned int i=0;i<std::min<size_t>(workers, jobs.size());i++)
+		threads.emplace_back(worker);
 
-namespace po = boost::program_options;
+	for(auto& t : threads)
+		t.join();
+
+	std::cerr << "Batch: " << jobs.size() << " jobs " << failed << " failed in "
+		<< std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count()
+		<< "s on " << threads.size() << " workers" << std::endl;
+
+	return failed ? 1 : 0;
+}
 
 int main(int argc, char* argv[]) {
 
 	po::options_description         desc("Allowed options");
 	desc.add_options()
 		("help,h", "produce help message")
-		("infile,i", po::value<std::string>()->required(), "Input file")
-		("dbname,d", po::value<std::string>()->required(), "Output database name")
+		("infile,i", po::value<std::string>(), "Input file")
+		("dbname,d", po::value<std::string>(), "Output database name")
+		("batch,b", po::value<std::string>(), "Manifest with one \"infile dbname [statsfile]\" per line")
+		("jobs,j", po::value<unsigned int>()->default_value(std::max(1u, std::thread::hardware_concurrency())), "Worker threads for batch mode")
+		("large-size", po::value<size_t>()->default_value(512), "Batch inputs of at least this many MB count as large")
+		("max-parallel-large", po::value<unsigned int>()->default_value(1), "Large batch inputs processed at the same time")
+		("hilbert", po::bool_switch()->default_value(false), "Process areas in Hilbert order of their envelope centre")
+		("giant,g", po::value<size_t>()->default_value(20000), "Vertex count above which areas get a segment index (0 disables)")
+		("no-adjacency", po::bool_switch()->default_value(false), "Do not detect glued neighbours - saves memory, no gap layer")
+		("stats,s", po::value<std::string>(), "Write run statistics as JSON to file")
+		("min-overlap-area", po::value<std::vector<std::string>>(), "Skip overlaps below m² as layer=value")
+		("min-overlap-ratio", po::value<std::vector<std::string>>(), "Skip overlaps below this ratio of the smaller area as layer=value")
+		("profile,p", po::value<size_t>(), "Report the N most expensive areas and pairs on stderr")
+		("profile-sample", po::value<uint32_t>()->default_value(1), "Only time every Nth profiled call")
+		("listen,l", po::value<std::string>(), "Keep the index and answer queries on this unix socket after the run")
 	;
 
         po::variables_map vm;
@@ -337,53 +345,29 @@ int main(int argc, char* argv[]) {
                 exit(-1);
         }
 
-	AreaIndex	areahandler;
-
-	osmium::io::File input_file{vm["infile"].as<std::string>()};
-
-	osmium::area::Assembler::config_type assembler_config;
-
-	osmium::TagsFilter areafilter{false};
-	areafilter.add_rule(true, osmium::TagMatcher{osmium::StringMatcher::equal{"landuse"}});
-	areafilter.add_rule(true, osmium::TagMatcher{osmium::StringMatcher::equal{"natural"}});
-	areafilter.add_rule(true, osmium::TagMatcher{osmium::StringMatcher::equal{"building"}});
-	areafilter.add_rule(true, osmium::TagMatcher{osmium::StringMatcher::equal{"amenity"}});
-	areafilter.add_rule(true, osmium::TagMatcher{osmium::StringMatcher::equal{"leisure"}});
-	areafilter.add_rule(true, osmium::TagMatcher{osmium::StringMatcher::equal{"man_made"}});
-	osmium::area::MultipolygonManager<osmium::area::Assembler> areamp_manager{assembler_config, areafilter};
-
-	// We read the input file twice. In the first pass, only relations are
-	// read and fed into the multipolygon manager.
-	osmium::relations::read_relations(input_file, areamp_manager);
-
-	index_type index;
-	location_handler_type location_handler{index};
-	location_handler.ignore_errors();
-
-	osmium::io::Reader reader{input_file};
-	osmium::apply(reader, location_handler,
-		areahandler,
-		areamp_manager.handler([&areahandler](osmium::memory::Buffer&& buffer) {
-			osmium::apply(buffer, areahandler);
-		})
-	);
-	reader.close();
-	std::cerr << "Pass 2 done\n";
+	if (vm.count("batch")) {
+		if (vm.count("infile") || vm.count("dbname") || vm.count("listen") || vm.count("stats")) {
+			std::cerr << "Error: --batch takes input, output and stats files from the manifest" << std::endl;
+			exit(-1);
+		}
+	} else if (!vm.count("infile") || !vm.count("dbname")) {
+		std::cerr << "Error: --infile and --dbname are required without --batch" << std::endl;
+		std::cerr << desc << std::endl;
+		exit(-1);
+	}
 
-	std::cerr << "Memory:\n";
-	osmium::relations::print_used_memory(std::cerr, areamp_manager.used_memory());
+	/* Bad arguments must not show up first in a worker thread */
+	Thresholds	thresholds;
+	thresholds.area=layervalues(vm, "min-overlap-area");
+	thresholds.ratio=layervalues(vm, "min-overlap-ratio");
 
 	OGRRegisterAll();
-	std::string		dbname=vm["dbname"].as<std::string>();
-	SpatiaLiteWriter	writer{dbname};
-
-	LanduseSize		ls{writer};
-	areahandler.foreach(ls);
-
-	AmenityIntersect	ai{writer};
-	areahandler.processoverlap(ai);
 
-	AreaOverlapCompare	luo{writer};
-	areahandler.processoverlap(luo);
+	if (vm.count("batch")) {
+		std::vector<BatchJob>	jobs=readmanifest(vm["batch"].as<std::string>());
+		return batch(vm, thresholds, jobs, std::max(1u, vm["jobs"].as<unsigned int>()));
+	}
 
+	run(vm, thresholds, vm["infile"].as<std::string>(), vm["dbname"].as<std::string>(),
+		vm.count("stats") ? vm["stats"].as<std::string>() : std::string());
 }
@@ -0,0 +1,441 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+
+#include <osmium/builder/osm_object_builder.hpp>
+#include <osmium/memory/buffer.hpp>
+
+#include <boost/program_options.hpp>
+
+#include "Area.hpp"
+#include "AreaIndex.hpp"
+#include "AreaCheck.hpp"
+#include "SpatiaLiteWriter.hpp"
+#include "LanduseChecks.hpp"
+
+/*
+ * Microbenchmarks for the hot parts of landuseoverlap. All input is
+ * generated from a fixed seed so runs are comparable. Results go to
+ * stderr as the writer reports features on stdout. Before timing the
+ * fast paths are checked against GEOS, any difference fails the run.
+ */
+
+class AreaAll : public AreaWant {
+	public:
+		const char *Name() const {
+			return "bench";
+		}
+
+		bool WantA(Area *) const {
+			return true;
+		}
+
+		bool WantB(Area *) const {
+			return true;
+		}
+};
+
+class AreaFactory {
+	std::mt19937			rng;
+	osmium::memory::Buffer		buffer{1024*1024, osmium::memory::Buffer::auto_grow::yes};
+	osmium::object_id_type		wayid=1;
+	osmium::object_id_type		nodeid=1;
+
+	double uniform(double min, double max) {
+		return std::uniform_real_distribution<double>(min, max)(rng);
+	}
+
+	public:
+	AreaFactory(uint32_t seed) : rng(seed) {}
+
+	/*
+	 * Star shaped ring around the centre so the polygon is always
+	 * valid. Radius is in degrees. The area stays valid until the
+	 * next build.
+	 */
+	const osmium::Area& build(double x, double y, double radius, size_t vertices, const char *key, const char *value) {
+		size_t	offset=buffer.committed();
+
+		{
+			osmium::builder::AreaBuilder	builder{buffer};
+			builder.set_id(wayid++*2);
+			builder.set_changeset(1);
+			builder.set_user("bench");
+
+			{
+				osmium::builder::TagListBuilder	tags{builder};
+				tags.add_tag(key, value);
+			}
+
+			{
+				osmium::builder::OuterRingBuilder	ring{builder};
+				osmium::object_id_type			first=nodeid;
+				osmium::Location			start;
+
+				for(size_t i=0;i<vertices;i++) {
+					double	angle=2*M_PI*i/vertices;
+					double	r=radius*uniform(0.8, 1.0);
+
+					osmium::Location	l{x+r*cos(angle), y+r*sin(angle)};
+					if (i == 0)
+						start=l;
+
+					ring.add_node_ref(osmium::NodeRef{nodeid++, l});
+				}
+
+				ring.add_node_ref(osmium::NodeRef{first, start});
+			}
+		}
+
+		buffer.commit();
+		return buffer.get<osmium::Area>(offset);
+	}
+
+	void create(AreaIndex& index, double x, double y, double radius, size_t vertices, const char *key, const char *value) {
+		index.area(build(x, y, radius, vertices, key, value));
+	}
+
+	void random(AreaIndex& index, size_t count, double radius, size_t vertices, const char *key, const char *value) {
+		for(size_t i=0;i<count;i++)
+			create(index, uniform(7.0, 8.0), uniform(51.0, 52.0), radius, vertices, key, value);
+	}
+};
+
+class Bench {
+	size_t			repeat;
+
+	public:
+	Bench(size_t repeat) : repeat(repeat) {}
+
+	/* Run f repeat times, report min and median of the runs */
+	template <typename F>
+	void run(const char *name, size_t ops, F f) {
+		std::vector<double>	times;
+
+		for(size_t i=0;i<repeat;i++) {
+			auto	start=std::chrono::steady_clock::now();
+			f();
+			times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count());
+		}
+
+		std::sort(times.begin(), times.end());
+
+		double	min=times.front();
+		double	median=times[times.size()/2];
+
+		std::cerr << std::left << std::setw(32) << name
+			<< std::right << std::fixed << std::setprecision(3)
+			<< " min " << std::setw(10) << min*1000 << "ms"
+			<< " median " << std::setw(10) << median*1000 << "ms"
+			<< " " << std::setw(12) << std::setprecision(0) << median/ops*1e9 << "ns/op"
+			<< std::endl;
+	}
+};
+
+/* Counts the checks and reports every mismatch with both objects */
+class Verify {
+	size_t			checks=0;
+	size_t			failed=0;
+
+	public:
+	void expect(bool ok, const char *what, Area *a, Area *b) {
+		checks++;
+		if (ok)
+			return;
+
+		failed++;
+		std::cerr << "MISMATCH " << what
+			<< " " << a->source_string() << " " << a->osm_id;
+		if (b)
+			std::cerr << " " << b->source_string() << " " << b->osm_id;
+		std::cerr << std::endl;
+	}
+
+	/* Areas in m² - equal up to rounding of the clipped vertices */
+	void expectarea(double clipped, double full, const char *what, Area *a, Area *b) {
+		double	tolerance=std::max(1e-6*std::fabs(full), 1e-3);
+		expect(std::fabs(clipped-full) <= tolerance, what, a, b);
+	}
+
+	bool ok(void ) const {
+		std::cerr << std::left << std::setw(32) << "verify"
+			<< std::right << " " << checks << " checks "
+			<< failed << " mismatches" << std::endl;
+		return failed == 0;
+	}
+};
+
+/* Fast paths of plain and indexed areas must agree with GEOS */
+static bool verify(std::vector<std::pair<Area*, Area*>>& pairs, Area *plain, Area *indexed,
+		std::vector<Area*>& small, size_t nhuge, size_t ngeos) {
+	Verify		v;
+
+	for(auto& p : pairs) {
+		const OGRGeometry	*ga=p.first->geometry;
+		const OGRGeometry	*gb=p.second->geometry;
+
+		v.expect(p.first->overlaps(p.second) == (ga->Overlaps(gb) || ga->Contains(gb) || ga->Within(gb)),
+			"overlaps small", p.first, p.second);
+		v.expect(p.first->intersects(p.second) == ga->Overlaps(gb),
+			"intersects small", p.first, p.second);
+	}
+
+	for(size_t i=0;i<nhuge;i++) {
+		Area	*s=small[i];
+
+		v.expect(plain->overlaps(s) == indexed->overlaps(s), "overlaps plain/indexed", indexed, s);
+		v.expect(plain->intersects(s) == indexed->intersects(s), "intersects plain/indexed", indexed, s);
+
+		switch(indexed->relate(s)) {
+			case(RELATE_CROSS):
+				v.expect(plain->geometry->Overlaps(s->geometry), "relate cross", indexed, s);
+				break;
+			case(RELATE_DISJOINT):
+				v.expect(!plain->geometry->Intersects(s->geometry), "relate disjoint", indexed, s);
+				break;
+			case(RELATE_CONTAINS):
+				v.expect(plain->geometry->Contains(s->geometry), "relate contains", indexed, s);
+				break;
+			case(RELATE_WITHIN):
+				v.expect(plain->geometry->Within(s->geometry), "relate within", indexed, s);
+				break;
+		}
+
+		OGREnvelope	env;
+		s->envelope(env);
+
+		OGRPoint	centre((env.MinX+env.MaxX)/2, (env.MinY+env.MaxY)/2);
+		v.expect(indexed->segindex->contains(centre.getX(), centre.getY()) == plain->geometry->Contains(&centre),
+			"segmentindex contains", indexed, s);
+	}
+
+	/* Below this GEOS works on the full huge polygon for every call */
+	std::unique_ptr<OGRGeometry>	boundary{plain->geometry->Boundary()};
+	std::vector<Segment>		segments;
+
+	for(size_t i=0;i<ngeos;i++) {
+		Area	*s=small[i];
+
+		segments.clear();
+		SegmentIndex::collect(s->geometry, segments);
+		for(auto& seg : segments) {
+			OGRLineString	line;
+			line.addPoint(seg.x1, seg.y1);
+			line.addPoint(seg.x2, seg.y2);
+
+			v.expect((indexed->segindex->crossing(seg) != CROSS_NONE) == boundary->Intersects(&line),
+				"segmentindex crossing", indexed, s);
+		}
+
+		OGREnvelope	env;
+		s->envelope(env);
+
+		OGRLinearRing	*ring=new OGRLinearRing();
+		ring->addPoint(env.MinX, env.MinY);
+		ring->addPoint(env.MaxX, env.MinY);
+		ring->addPoint(env.MaxX, env.MaxY);
+		ring->addPoint(env.MinX, env.MaxY);
+		ring->addPoint(env.MinX, env.MinY);
+		OGRPolygon	window;
+		window.addRingDirectly(ring);
+
+		std::unique_ptr<OGRGeometry>	clip{indexed->clipped(env)};
+		std::unique_ptr<OGRGeometry>	full{plain->geometry->Intersection(&window)};
+		v.expectarea(squaremeters(clip.get()), full ? squaremeters(full.get()) : 0,
+			"clipped envelope", indexed, s);
+
+		std::unique_ptr<OGRGeometry>	ci{clippedintersection(indexed, s)};
+		std::unique_ptr<OGRGeometry>	fi{plain->geometry->Intersection(s->geometry)};
+		v.expectarea(ci ? squaremeters(ci.get()) : 0, fi ? squaremeters(fi.get()) : 0,
+			"clipped intersection", indexed, s);
+	}
+
+	return v.ok();
+}
+
+static void findpairs(AreaIndex& index, AreaWant& want, std::vector<std::pair<Area*, Area*>>& pairs) {
+	std::vector<Area*>	list;
+
+	pairs.clear();
+	for(auto a : index.arealist) {
+		index.findoverlapping(a, &list, want);
+		for(auto b : list)
+			if (a->id < b->id)
+				pairs.push_back(std::make_pair(a, b));
+		list.clear();
+	}
+}
+
+namespace po = boost::program_options;
+
+int main(int argc, char* argv[]) {
+
+	po::options_description         desc("Allowed options");
+	desc.add_options()
+		("help,h", "produce help message")
+		("areas,n", po::value<size_t>()->default_value(20000), "Number of small areas")
+		("huge", po::value<size_t>()->default_value(100000), "Vertex count of the huge polygon")
+		("repeat,r", po::value<size_t>()->default_value(5), "Runs per benchmark")
+		("seed", po::value<uint32_t>()->default_value(42), "Random seed")
+		("verify", po::value<size_t>()->default_value(100), "Small areas checked against GEOS on the full huge polygon")
+		("verify-only", po::bool_switch()->default_value(false), "Only check results, skip the timings")
+		("dbname,d", po::value<std::string>()->default_value("landuseoverlap_bench.sqlite"), "Scratch output database")
+	;
+
+	po::variables_map vm;
+	try {
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+	} catch(const boost::program_options::error& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		std::cerr << desc << std::endl;
+		exit(-1);
+	}
+
+	if (vm.count("help")) {
+		std::cerr << desc << std::endl;
+		exit(0);
+	}
+
+	size_t		count=vm["areas"].as<size_t>();
+	size_t		hugevertices=vm["huge"].as<size_t>();
+	uint32_t	seed=vm["seed"].as<uint32_t>();
+	Bench		bench{vm["repeat"].as<size_t>()};
+	AreaAll		all;
+
+	OGRRegisterAll();
+
+	/* Small areas of roughly 100m radius scattered over a 1x1 degree box */
+	AreaIndex	small;
+	small.setgiant(0);
+	/* Every dataset gets its own generator so -r does not change the input */
+	AreaFactory	smallfactory{seed};
+	smallfactory.random(small, count, 0.001, 12, "landuse", "meadow");
+
+	std::vector<std::pair<Area*, Area*>>	pairs;
+	findpairs(small, all, pairs);
+
+	/* One huge polygon with and without segment index against small ones inside it */
+	AreaIndex	hugeplain, hugeindexed;
+	hugeplain.setgiant(0);
+	hugeindexed.setgiant(1000);
+	AreaFactory		hugefactory{seed+1};
+	const osmium::Area&	huge=hugefactory.build(7.5, 51.5, 0.4, hugevertices, "natural", "wood");
+	hugeplain.area(huge);
+	hugeindexed.area(huge);
+	Area	*plain=hugeplain.arealist.front();
+	Area	*indexed=hugeindexed.arealist.front();
+
+	size_t	nhuge=std::min<size_t>(count, 1000);
+
+	if (!verify(pairs, plain, indexed, small.arealist, nhuge,
+			std::min<size_t>(nhuge, vm["verify"].as<size_t>()))) {
+		std::cerr << "Fast paths disagree with GEOS - timings are meaningless" << std::endl;
+		exit(1);
+	}
+
+	if (vm["verify-only"].as<bool>())
+		exit(0);
+
+	bench.run("ingest small", count, [&]() {
+		AreaIndex	index;
+		AreaFactory	factory{seed};
+		index.setgiant(0);
+		factory.random(index, count, 0.001, 12, "landuse", "meadow");
+		for(auto a : index.arealist)
+			delete(a);
+	});
+
+	bench.run("AreaIndex::insert", count, [&]() {
+		AreaIndex	index;
+		for(auto a : small.arealist)
+			index.insert(a);
+	});
+
+	bench.run("AreaIndex::bulkload", count, [&]() {
+		AreaIndex	index;
+		index.arealist=small.arealist;
+		index.bulkload();
+	});
+
+	bench.run("AreaIndex::findoverlapping", count, [&]() {
+		findpairs(small, all, pairs);
+	});
+
+	size_t	npairs=std::max<size_t>(1, pairs.size());
+
+	bench.run("Area::overlaps small", npairs, [&]() {
+		for(auto& p : pairs)
+			p.first->overlaps(p.second);
+	});
+
+	bench.run("Area::intersects small", npairs, [&]() {
+		for(auto& p : pairs)
+			p.first->intersects(p.second);
+	});
+
+	bench.run("Area::overlaps huge", nhuge, [&]() {
+		for(size_t i=0;i<nhuge;i++)
+			plain->overlaps(small.arealist[i]);
+	});
+
+	bench.run("Area::overlaps huge indexed", nhuge, [&]() {
+		for(size_t i=0;i<nhuge;i++)
+			indexed->overlaps(small.arealist[i]);
+	});
+
+	bench.run("Area::intersects huge", nhuge, [&]() {
+		for(size_t i=0;i<nhuge;i++)
+			plain->intersects(small.arealist[i]);
+	});
+
+	bench.run("Area::intersects huge indexed", nhuge, [&]() {
+		for(size_t i=0;i<nhuge;i++)
+			indexed->intersects(small.arealist[i]);
+	});
+
+	std::string	dbname=vm["dbname"].as<std::string>();
+	std::remove(dbname.c_str());
+
+	{
+		SpatiaLiteWriter	writer{dbname};
+		LanduseSize		ls{writer};
+		AmenityIntersect	ai{writer};
+
+		bench.run("polygon_complexity small", count, [&]() {
+			for(auto a : small.arealist)
+				ls.polygon_complexity(a->geometry);
+		});
+
+		bench.run("polygon_complexity huge", 1, [&]() {
+			ls.polygon_complexity(plain->geometry);
+		});
+
+		bench.run("write_overlap small", npairs, [&]() {
+			for(auto& p : pairs)
+				writer.write_overlap(p.first, p.second, "hierarchy");
+		});
+
+		bench.run("write_overlap huge", nhuge, [&]() {
+			for(size_t i=0;i<nhuge;i++)
+				writer.write_overlap(plain, small.arealist[i], "hierarchy");
+		});
+
+		bench.run("write_overlap huge indexed", nhuge, [&]() {
+			for(size_t i=0;i<nhuge;i++)
+				writer.write_overlap(indexed, small.arealist[i], "hierarchy");
+		});
+
+		bench.run("writeAreaLayer", count, [&]() {
+			for(auto a : small.arealist)
+				writer.writeAreaLayer("suspicious", a, "bench", "bench");
+		});
+	}
+
+	std::remove(dbname.c_str());
+}
@@ -0,0 +1,434 @@
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <osmium/builder/osm_object_builder.hpp>
+#include <osmium/io/any_output.hpp>
+#include <osmium/memory/buffer.hpp>
+
+#include <boost/program_options.hpp>
+
+/*
+ * Generates synthetic landuse data with a known number of overlapping,
+ * contained, glued and nearly glued pairs. Nodes, ways and relations must be written
+ * in that order so the generator is run three times with the same seed,
+ * each pass emitting one object type. Nothing has to be kept in memory.
+ */
+
+enum {
+	EMIT_NODES,
+	EMIT_WAYS,
+	EMIT_RELATIONS
+};
+
+class Truth {
+	public:
+	uint64_t				areas=0;
+	uint64_t				overlap=0;
+	uint64_t				natural=0;
+	uint64_t				hierarchy=0;
+	uint64_t				gap=0;
+};
+
+class Generator {
+	osmium::io::Writer&		writer;
+	osmium::memory::Buffer		buffer{1024*1024, osmium::memory::Buffer::auto_grow::yes};
+	std::mt19937			rng;
+	int				emit;
+
+	osmium::object_id_type		nodeid=0;
+	osmium::object_id_type		wayid=0;
+	osmium::object_id_type		relationid=0;
+
+	double				cellsize=0.005;
+	size_t				columns;
+
+	size_t				minvertices;
+	size_t				maxvertices;
+
+	double uniform(double min, double max) {
+		return std::uniform_real_distribution<double>(min, max)(rng);
+	}
+
+	void flush(bool force=false) {
+		if (buffer.committed() == 0)
+			return;
+		if (!force && buffer.committed() < 800*1024)
+			return;
+		writer(std::move(buffer));
+		buffer=osmium::memory::Buffer{1024*1024, osmium::memory::Buffer::auto_grow::yes};
+	}
+
+	osmium::object_id_type node(double x, double y) {
+		nodeid++;
+
+		if (emit == EMIT_NODES) {
+			{
+				osmium::builder::NodeBuilder	builder{buffer};
+				builder.set_id(nodeid);
+				builder.set_version(1);
+				builder.set_changeset(1);
+				builder.set_timestamp(osmium::Timestamp{1577836800});
+				builder.set_user("gen");
+				builder.set_location(osmium::Location{x, y});
+			}
+			buffer.commit();
+			flush();
+		}
+
+		return nodeid;
+	}
+
+	osmium::object_id_type way(const std::vector<osmium::object_id_type>& nodes, const char *key, const char *value) {
+		wayid++;
+
+		if (emit == EMIT_WAYS) {
+			{
+				osmium::builder::WayBuilder	builder{buffer};
+				builder.set_id(wayid);
+				builder.set_version(1);
+				builder.set_changeset(1);
+				builder.set_timestamp(osmium::Timestamp{1577836800});
+				builder.set_user("gen");
+
+				if (key) {
+					osmium::builder::TagListBuilder	tags{builder};
+					tags.add_tag(key, value);
+				}
+
+				{
+					osmium::builder::WayNodeListBuilder	wnl{builder};
+					for(auto n : nodes)
+						wnl.add_node_ref(n);
+				}
+			}
+			buffer.commit();
+			flush();
+		}
+
+		return wayid;
+	}
+
+	void multipolygon(const std::vector<osmium::object_id_type>& ways, const char *key, const char *value) {
+		relationid++;
+
+		if (emit != EMIT_RELATIONS)
+			return;
+
+		{
+			osmium::builder::RelationBuilder	builder{buffer};
+			builder.set_id(relationid);
+			builder.set_version(1);
+			builder.set_changeset(1);
+			builder.set_timestamp(osmium::Timestamp{1577836800});
+			builder.set_user("gen");
+
+			{
+				osmium::builder::TagListBuilder	tags{builder};
+				tags.add_tag("type", "multipolygon");
+				tags.add_tag(key, value);
+			}
+
+			{
+				osmium::builder::RelationMemberListBuilder	members{builder};
+				for(auto w : ways)
+					members.add_member(osmium::item_type::way, w, "outer");
+			}
+		}
+		buffer.commit();
+		flush();
+	}
+
+	/* Log-uniform so most areas are simple and a few are detailed */
+	size_t vertices(void ) {
+		return exp(uniform(log(minvertices), log(maxvertices+1)));
+	}
+
+	/*
+	 * Star shaped and thus always valid closed way around x/y. Random
+	 * draws happen in statement order so output does not depend on the
+	 * compilers argument evaluation order.
+	 */
+	void star(double x, double y, double radius, const char *key, const char *value) {
+		std::vector<osmium::object_id_type>	nodes;
+		size_t					count=vertices();
+
+		for(size_t i=0;i<count;i++) {
+			double	angle=2*M_PI*i/count;
+			double	r=radius*uniform(0.8, 1.0);
+			nodes.push_back(node(x+r*cos(angle), y+r*sin(angle)));
+		}
+		nodes.push_back(nodes.front());
+
+		way(nodes, key, value);
+	}
+
+	void cell(size_t n, double& x, double& y) {
+		x=7.0+(n%columns)*cellsize+cellsize/2;
+		y=51.0+(n/columns)*cellsize+cellsize/2;
+	}
+
+	public:
+	Generator(osmium::io::Writer& writer, uint32_t seed, int emit, size_t cells, size_t minvertices, size_t maxvertices) :
+			writer(writer), rng(seed), emit(emit),
+			minvertices(std::max<size_t>(3, minvertices)), maxvertices(std::max(minvertices, maxvertices)) {
+		columns=std::max<size_t>(1, sqrt(cells));
+	}
+
+	~Generator() {
+		flush(true);
+	}
+
+	const char *pairkey(bool natural) {
+		return natural ? "natural" : "landuse";
+	}
+
+	const char *pairvalue(bool natural) {
+		static const char	*landuse[]={ "meadow", "farmland", "residential" };
+		static const char	*naturals[]={ "wood", "scrub" };
+
+		if (natural)
+			return naturals[rng()%2];
+		return landuse[rng()%3];
+	}
+
+	/* Two stars of the same size shifted by their radius - partial overlap */
+	void overlapping(size_t n, Truth& truth) {
+		double	x, y, r=cellsize*0.15;
+		bool	natural=(rng()%3 == 0);
+
+		cell(n, x, y);
+
+		const char	*v1=pairvalue(natural);
+		star(x, y, r, pairkey(natural), v1);
+
+		const char	*v2=pairvalue(natural);
+		star(x+r, y, r, pairkey(natural), v2);
+
+		truth.areas+=2;
+		truth.hierarchy++;
+		if (natural)
+			truth.natural++;
+		else
+			truth.overlap++;
+	}
+
+	/* A small star well inside the inner radius of a larger one */
+	void contained(size_t n, Truth& truth) {
+		double	x, y, r=cellsize*0.3;
+		bool	natural=(rng()%3 == 0);
+
+		cell(n, x, y);
+
+		const char	*v1=pairvalue(natural);
+		star(x, y, r, pairkey(natural), v1);
+
+		const char	*v2=pairvalue(natural);
+		star(x, y, r*0.3, pairkey(natural), v2);
+
+		truth.areas+=2;
+		if (natural)
+			truth.natural++;
+		else
+			truth.overlap++;
+	}
+
+	/* Two rectangles sharing the nodes of their common edge */
+	void glued(size_t n, Truth& truth) {
+		double	x, y, w=cellsize*0.2;
+		bool	natural=(rng()%3 == 0);
+
+		cell(n, x, y);
+
+		osmium::object_id_type	bottom=node(x, y-w);
+		osmium::object_id_type	middle=node(x, y);
+		osmium::object_id_type	top=node(x, y+w);
+
+		osmium::object_id_type	lt=node(x-w, y+w);
+		osmium::object_id_type	lb=node(x-w, y-w);
+		osmium::object_id_type	rb=node(x+w, y-w);
+		osmium::object_id_type	rt=node(x+w, y+w);
+
+		const char	*v1=pairvalue(natural);
+		way({ bottom, middle, top, lt, lb, bottom }, pairkey(natural), v1);
+
+		const char	*v2=pairvalue(natural);
+		way({ bottom, rb, rt, top, middle, bottom }, pairkey(natural), v2);
+
+		truth.areas+=2;
+	}
+
+	/*
+	 * Like glued but only the corners are shared. The left rectangle has
+	 * a vertex 0.3-0.8m off the straight edge of the right one which
+	 * leaves a sliver between them - one gap, no overlap.
+	 */
+	void neargap(size_t n, Truth& truth) {
+		double	x, y, w=cellsize*0.2;
+		bool	natural=(rng()%3 == 0);
+
+		cell(n, x, y);
+
+		double	offset=uniform(0.3, 0.8)/111320/cos(y*M_PI/180);
+
+		osmium::object_id_type	bottom=node(x, y-w);
+		osmium::object_id_type	top=node(x, y+w);
+		osmium::object_id_type	bend=node(x-offset, y);
+		osmium::object_id_type	lower=node(x, y-w/3);
+		osmium::object_id_type	upper=node(x, y+w/3);
+
+		osmium::object_id_type	lt=node(x-w, y+w);
+		osmium::object_id_type	lb=node(x-w, y-w);
+		osmium::object_id_type	rb=node(x+w, y-w);
+		osmium::object_id_type	rt=node(x+w, y+w);
+
+		const char	*v1=pairvalue(natural);
+		way({ bottom, bend, top, lt, lb, bottom }, pairkey(natural), v1);
+
+		const char	*v2=pairvalue(natural);
+		way({ bottom, rb, rt, top, upper, lower, bottom }, pairkey(natural), v2);
+
+		truth.areas+=2;
+		truth.gap++;
+	}
+
+	void single(size_t n, Truth& truth) {
+		static const char	*keys[]={ "landuse", "landuse", "natural", "building", "building", "amenity" };
+		static const char	*values[]={ "grass", "forest", "heath", "yes", "house", "parking" };
+		double			x, y;
+		size_t			k=rng()%6;
+
+		cell(n, x, y);
+
+		double	r=cellsize*uniform(0.05, 0.3);
+		star(x, y, r, keys[k], values[k]);
+
+		truth.areas++;
+	}
+
+	/*
+	 * A natural=wood multipolygon split into ways of at most 2000 nodes
+	 * like in real data, with small landuses inside it.
+	 */
+	void giant(size_t n, size_t count, size_t inside, Truth& truth) {
+		double	x=5.0-n*0.5, y=50.0, r=0.2;
+
+		std::vector<osmium::object_id_type>	nodes;
+		for(size_t i=0;i<count;i++) {
+			double	angle=2*M_PI*i/count;
+			double	jitter=r*uniform(0.9, 1.0);
+			nodes.push_back(node(x+jitter*cos(angle), y+jitter*sin(angle)));
+		}
+		nodes.push_back(nodes.front());
+
+		std::vector<osmium::object_id_type>	ways;
+		for(size_t start=0;start+1<nodes.size();start+=1999) {
+			size_t	end=std::min(start+1999, nodes.size()-1);
+			ways.push_back(way(std::vector<osmium::object_id_type>(nodes.begin()+start, nodes.begin()+end+1), nullptr, nullptr));
+		}
+
+		multipolygon(ways, "natural", "wood");
+		truth.areas++;
+
+		/* Landuses on a grid well inside the inner radius */
+		size_t	side=std::max<size_t>(1, ceil(sqrt(inside)));
+		double	step=r*1.2/side;
+
+		for(size_t i=0;i<inside;i++) {
+			double	ix=x-r*0.6+(i%side+0.5)*step;
+			double	iy=y-r*0.6+(i/side+0.5)*step;
+
+			star(ix, iy, step*0.3, "landuse", "meadow");
+			truth.areas++;
+			truth.natural++;
+		}
+	}
+};
+
+namespace po = boost::program_options;
+
+int main(int argc, char* argv[]) {
+
+	po::options_description         desc("Allowed options");
+	desc.add_options()
+		("help,h", "produce help message")
+		("outfile,o", po::value<std::string>()->required(), "Output file (.pbf/.osm)")
+		("truth,t", po::value<std::string>(), "Write expected findings as JSON")
+		("areas,n", po::value<size_t>()->default_value(10000), "Number of areas")
+		("overlap", po::value<double>()->default_value(0.1), "Fraction of areas in partially overlapping pairs")
+		("contained", po::value<double>()->default_value(0.05), "Fraction of areas in contained pairs")
+		("glued", po::value<double>()->default_value(0.2), "Fraction of areas in glued pairs")
+		("near-glued", po::value<double>()->default_value(0.02), "Fraction of areas in glued pairs with a vertex less than 1m off the neighbour")
+		("min-vertices", po::value<size_t>()->default_value(4), "Minimum vertices per area")
+		("max-vertices", po::value<size_t>()->default_value(64), "Maximum vertices per area")
+		("giant", po::value<size_t>()->default_value(2), "Number of giant multipolygons")
+		("giant-vertices", po::value<size_t>()->default_value(100000), "Vertices per giant multipolygon")
+		("giant-inside", po::value<size_t>()->default_value(100), "Landuses contained in each giant")
+		("seed", po::value<uint32_t>()->default_value(1), "Random seed")
+	;
+
+	po::variables_map vm;
+	try {
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+	} catch(const boost::program_options::error& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		std::cerr << desc << std::endl;
+		exit(-1);
+	}
+
+	size_t		areas=vm["areas"].as<size_t>();
+	size_t		overlaps=areas*vm["overlap"].as<double>()/2;
+	size_t		contains=areas*vm["contained"].as<double>()/2;
+	size_t		glues=areas*vm["glued"].as<double>()/2;
+	size_t		gaps=areas*vm["near-glued"].as<double>()/2;
+	size_t		singles=areas-std::min(areas, 2*(overlaps+contains+glues+gaps));
+	size_t		cells=overlaps+contains+glues+gaps+singles;
+
+	osmium::io::Header	header;
+	header.set("generator", "landuseoverlap_gen");
+
+	osmium::io::File	outfile{vm["outfile"].as<std::string>()};
+	osmium::io::Writer	writer{outfile, header, osmium::io::overwrite::allow};
+
+	Truth	truth;
+
+	for(int emit=EMIT_NODES;emit<=EMIT_RELATIONS;emit++) {
+		Generator	gen{writer, vm["seed"].as<uint32_t>(), emit, cells,
+				vm["min-vertices"].as<size_t>(), vm["max-vertices"].as<size_t>()};
+
+		/* Every pass produces the same objects - count only once */
+		Truth	t;
+		size_t	n=0;
+
+		for(size_t i=0;i<overlaps;i++)
+			gen.overlapping(n++, t);
+		for(size_t i=0;i<contains;i++)
+			gen.contained(n++, t);
+		for(size_t i=0;i<glues;i++)
+			gen.glued(n++, t);
+		for(size_t i=0;i<gaps;i++)
+			gen.neargap(n++, t);
+		for(size_t i=0;i<singles;i++)
+			gen.single(n++, t);
+		for(size_t i=0;i<vm["giant"].as<size_t>();i++)
+			gen.giant(i, vm["giant-vertices"].as<size_t>(), vm["giant-inside"].as<size_t>(), t);
+
+		truth=t;
+	}
+
+	writer.close();
+
+	if (vm.count("truth")) {
+		std::ofstream	out(vm["truth"].as<std::string>());
+		out << "{" << std::endl
+			<< "\t\"areas\": " << truth.areas << "," << std::endl
+			<< "\t\"overlap\": " << truth.overlap << "," << std::endl
+			<< "\t\"natural\": " << truth.natural << "," << std::endl
+			<< "\t\"hierarchy\": " << truth.hierarchy << "," << std::endl
+			<< "\t\"gap\": " << truth.gap << std::endl
+			<< "}" << std::endl;
+	}
+}
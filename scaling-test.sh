@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# End to end scaling test on generated data. Runs landuseoverlap on
+# 10^4 up to 10^MAX areas, compares the findings with the ground truth
+# of the generator and plots wall time and peak memory.
+#
+# Usage: scaling-test.sh [MAX] - run from the build directory or set BIN
+#
+
+MAX=${1:-6}
+BIN=${BIN:-.}
+OUT=${OUT:-scaling}
+
+mkdir -p $OUT
+: > $OUT/results.dat
+
+fail=0
+e=4
+while [ $e -le $MAX ]; do
+	n=$(awk "BEGIN { printf \"%d\", 10^$e }")
+
+	echo "Generating $n areas"
+	$BIN/landuseoverlap_gen -o $OUT/gen-$n.pbf -t $OUT/truth-$n.json -n $n --seed 1 || exit 1
+
+	rm -f $OUT/out-$n.sqlite
+	/usr/bin/time -f "%e %M" -o $OUT/time-$n.txt \
+		$BIN/landuseoverlap -i $OUT/gen-$n.pbf -d $OUT/out-$n.sqlite \
+			--stats $OUT/stats-$n.json >/dev/null 2>$OUT/log-$n.txt || exit 1
+
+	read wall rss < $OUT/time-$n.txt
+	echo "$n $wall $rss" >> $OUT/results.dat
+	echo "$n areas: ${wall}s ${rss}KB peak RSS"
+
+	for layer in overlap natural hierarchy gap; do
+		want=$(sed -n "s/.*\"$layer\": \([0-9]*\).*/\1/p" $OUT/truth-$n.json)
+		got=$(sqlite3 $OUT/out-$n.sqlite "SELECT count(*) FROM $layer")
+		if [ "$want" != "$got" ]; then
+			echo "FAIL $n areas layer $layer expected $want got $got"
+			fail=1
+		fi
+	done
+
+	e=$((e+1))
+done
+
+if command -v gnuplot >/dev/null; then
+	gnuplot <<PLOT
+set terminal png size 1200,500
+set output "$OUT/scaling.png"
+set logscale xy
+set grid
+set xlabel "areas"
+set multiplot layout 1,2
+set ylabel "wall time (s)"
+plot "$OUT/results.dat" using 1:2 with linespoints title "wall time"
+set ylabel "peak RSS (MB)"
+plot "$OUT/results.dat" using 1:(\$3/1024) with linespoints title "peak memory"
+unset multiplot
+PLOT
+	echo "Plot written to $OUT/scaling.png"
+fi
+
+exit $fail